@@ -51,19 +51,19 @@ void filesystem::inode_t::unblocked_save_header(const inode_header_t header)
 std::vector < uint64_t > filesystem::inode_t::get_inode_block_pointers()
 {
     std::vector < uint64_t > block_pointers;
-    block_pointers.resize((block_size - sizeof(inode_header_t)) / sizeof(uint64_t));
-    fs.read_block(inode_id, block_pointers.data(), block_pointers.size() * sizeof(uint64_t), sizeof(inode_header_t));
+    block_pointers.resize((block_size - pointers_offset) / sizeof(uint64_t));
+    fs.read_block(inode_id, block_pointers.data(), block_pointers.size() * sizeof(uint64_t), pointers_offset);
     return block_pointers;
 }
 
 void filesystem::inode_t::save_inode_block_pointers(const std::vector < uint64_t > & block_pointers)
 {
-    fs.write_block(inode_id, block_pointers.data(), block_pointers.size() * sizeof(uint64_t), sizeof(inode_header_t), true);
+    fs.write_block(inode_id, block_pointers.data(), block_pointers.size() * sizeof(uint64_t), pointers_offset, true);
 }
 
 filesystem::inode_t::inode_t(filesystem & fs, const uint64_t inode_id, const uint64_t block_size)
     : fs(fs), inode_id(inode_id), block_size(block_size),
-        inode_level_pointers((block_size - sizeof(inode_header_t)) / sizeof(uint64_t)),
+        inode_level_pointers((block_size - pointers_offset) / sizeof(uint64_t)),
         block_max_entries(block_size / sizeof(uint64_t))
 {
 }
@@ -124,6 +124,7 @@ void filesystem::inode_t::unlink_self()
         }
     };
 
+    fs.cap_reservation(inode_id, 0); // while the inode block is still allocated
     unlink_blocks(level2_blocks);
     unlink_blocks(level3_blocks);
     unlink_blocks(level1_blocks);
@@ -196,8 +197,9 @@ void filesystem::inode_t::save_pointer_to_block(const uint64_t data_field_block_
     fs.write_block(data_field_block_id, block_pointers.data(), block_pointers.size() * sizeof(uint64_t), 0, true);
 }
 
-void filesystem::inode_t::unblocked_resize(const uint64_t file_length)
+void filesystem::inode_t::unblocked_resize(const uint64_t file_length, const bool sparse)
 {
+    allocation_hint_scope_t allocation_hint_scope(fs, inode_id);
     auto header = unblocked_get_header();
     if (static_cast<uint64_t>(header.attributes.st_size) == file_length) return;
     std::vector < std::unique_ptr<level3> > level3s_;
@@ -206,7 +208,7 @@ void filesystem::inode_t::unblocked_resize(const uint64_t file_length)
 
     const auto abstracted_mapping = pointer_mapping_linear_to_abstracted(
         file_length, inode_level_pointers, block_max_entries, block_size);
-    const auto actual_level3s = linearized_level3_pointers();
+    const auto actual_level3s = level3_pointers_by_position();
     const auto actual_level2s = linearized_level2_pointers();
     auto actual_level1s = get_inode_block_pointers();
     std::erase_if(actual_level1s, [](const uint64_t p)->bool{ return p == 0; });
@@ -215,7 +217,8 @@ void filesystem::inode_t::unblocked_resize(const uint64_t file_length)
     level1s_.resize(actual_level1s.size());
 
     for (uint64_t i = 0; i < actual_level3s.size(); i++) {
-        level3s_[i] = std::make_unique<level3>(actual_level3s[i], fs, true, block_size, true);
+        // holes are kept as they are, with nothing to delete when cut off
+        level3s_[i] = std::make_unique<level3>(actual_level3s[i], fs, actual_level3s[i] != 0, block_size, true);
     }
 
     for (uint64_t i = 0; i < actual_level2s.size(); i++) {
@@ -229,6 +232,23 @@ void filesystem::inode_t::unblocked_resize(const uint64_t file_length)
     level3s_.resize(abstracted_mapping.level3_pointers);
     level2s_.resize(abstracted_mapping.level2_pointers);
     level1s_.resize(abstracted_mapping.inode_level_pointers);
+    if (sparse) {
+        for (auto & level3 : level3s_) {
+            if (level3 == nullptr) {
+                level3 = std::make_unique<class level3>(0, fs, false, block_size, true);
+            }
+        }
+    }
+
+    // new storage blocks are allocated first, so they come out of the same extents in file order
+    struct preallocation_t {
+        filesystem & fs;
+        ~preallocation_t() { fs.release_preallocated_blocks(); }
+    } preallocation { fs };
+    const auto new_blocks = [](const std::vector < std::unique_ptr<level3> > & level)->uint64_t {
+        return std::ranges::count_if(level, [](const auto & p)->bool { return p == nullptr; });
+    };
+    fs.preallocate_blocks(new_blocks(level3s_) + new_blocks(level2s_) + new_blocks(level1s_));
 
     for (auto & level3 : level3s_) {
         if (level3 == nullptr) {
@@ -315,50 +335,75 @@ void filesystem::inode_t::unblocked_resize(const uint64_t file_length)
     header.attributes.st_size = static_cast<long>(file_length);
     header.attributes.st_ctim = get_current_time();
     unblocked_save_header(header);
+
+    // holes cut off take their reservations with them
+    fs.cap_reservation(inode_id, std::ranges::count_if(level3s_, [](const auto & p)->bool { return p->data_field_block_id == 0; }));
 }
 
-void filesystem::inode_t::redirect_3rd_level_block(const uint64_t old_data_field_block_id, const uint64_t new_data_field_block_id)
+void filesystem::inode_t::fallocate(const uint64_t offset, const uint64_t length)
 {
-    auto safe_delete = [&](const uint64_t block_id)
-    {
-        assert_short(block_id != 0);
-        const auto attr = fs.get_attr(block_id);
-        if (attr.links > 1) {
-            fs.delink_block(block_id);
-        } else if (attr.links == 1 && !attr.frozen) {
-            fs.deallocate_block(block_id);
-        }
-    };
+    allocation_hint_scope_t allocation_hint_scope(fs, inode_id);
+    const uint64_t file_length = std::max<uint64_t>(unblocked_get_header().attributes.st_size, offset + length);
+    const auto positions = level3_pointers_by_position();
+
+    // any hole write takes from the same reservation, so every hole of the file is reserved, not only
+    // those in the range. positions past the current end are all new holes
+    const uint64_t holes = std::ranges::count(positions, 0) + ceil_div(file_length, block_size) - positions.size();
+    const uint64_t reserved = fs.reservation_of(inode_id);
+    fs.reserve_for_inode(inode_id, holes - std::min(holes, reserved));
+    if (file_length == static_cast<uint64_t>(unblocked_get_header().attributes.st_size)) {
+        return;
+    }
 
-    auto try_save = [&](uint64_t & pointer, const std::vector<uint64_t> & data)->bool
-    {
-        // 1. check level 2 block, see if it's frozen
-        if (auto this_level_blk_ptr_attr = fs.get_attr(pointer); !this_level_blk_ptr_attr.frozen) {
-            save_pointer_to_block(pointer, data);
-            return false;
-        }
-        else
-        {
-            const auto new_block = fs.allocate_new_block();
+    try {
+        unblocked_resize(file_length, true);
+    } catch (...) {
+        fs.cap_reservation(inode_id, reserved);
+        throw;
+    }
+}
+
+void filesystem::inode_t::drop_block_link(const uint64_t data_field_block_id)
+{
+    assert_short(data_field_block_id != 0);
+    const auto attr = fs.get_attr(data_field_block_id);
+    if (attr.links > 1) {
+        fs.delink_block(data_field_block_id);
+    } else if (attr.links == 1 && !attr.frozen) {
+        fs.deallocate_block(data_field_block_id);
+    }
+}
+
+bool filesystem::inode_t::save_pointer_to_block_or_copy(uint64_t & data_field_block_id, const std::vector<uint64_t> & block_pointers)
+{
+    // 1. check pointer block, see if it's frozen
+    auto this_level_blk_ptr_attr = fs.get_attr(data_field_block_id);
+    if (!this_level_blk_ptr_attr.frozen) {
+        save_pointer_to_block(data_field_block_id, block_pointers);
+        return false;
+    }
 
-            // 1. update block attributes
-            this_level_blk_ptr_attr.frozen = 0;
-            this_level_blk_ptr_attr.links = 1; // this block is not linked to multiple nodes, unlike previous
-            fs.set_attr(new_block, this_level_blk_ptr_attr);
+    const auto new_block = fs.allocate_new_block();
 
-            // 2. copy data over
-            save_pointer_to_block(new_block, data);
+    // 2. update block attributes
+    this_level_blk_ptr_attr.frozen = 0;
+    this_level_blk_ptr_attr.links = 1; // this block is not linked to multiple nodes, unlike previous
+    fs.set_attr(new_block, this_level_blk_ptr_attr);
 
-            // 3. unlink old block
-            safe_delete(pointer);
+    // 3. copy data over
+    save_pointer_to_block(new_block, block_pointers);
 
-            debug_log("Redirecting immune block pointer ", pointer, " to new pointer block ", new_block);
-            // 4. update parent
-            pointer = new_block;
-            return true;
-        }
-    };
+    // 4. unlink old block
+    drop_block_link(data_field_block_id);
+
+    debug_log("Redirecting immune block pointer ", data_field_block_id, " to new pointer block ", new_block);
+    // 5. update parent
+    data_field_block_id = new_block;
+    return true;
+}
 
+void filesystem::inode_t::redirect_3rd_level_block(const uint64_t old_data_field_block_id, const uint64_t new_data_field_block_id)
+{
     auto level1 = get_inode_block_pointers();
     bool level1_pointers_changed = false;
 
@@ -379,7 +424,7 @@ void filesystem::inode_t::redirect_3rd_level_block(const uint64_t old_data_field
                         if (lv3_blk != 0 && lv3_blk == old_data_field_block_id)
                         {
                             // redirect means the original block will lose one inode link
-                            safe_delete(lv3_blk);
+                            drop_block_link(lv3_blk);
                             lv3_blk = new_data_field_block_id;
                             found = true;
                             debug_log("Redirect block pointer from ", old_data_field_block_id, " to ", new_data_field_block_id);
@@ -388,14 +433,14 @@ void filesystem::inode_t::redirect_3rd_level_block(const uint64_t old_data_field
                     }
 
                     if (found) {
-                        level2_pointers_changed = try_save(lv2_blk, lv3_blks);
+                        level2_pointers_changed = save_pointer_to_block_or_copy(lv2_blk, lv3_blks);
                         break;
                     }
                 }
             }
 
             if (level2_pointers_changed) {
-                level1_pointers_changed = try_save(lv1_blk, lv2_blks);
+                level1_pointers_changed = save_pointer_to_block_or_copy(lv1_blk, lv2_blks);
                 break;
             }
         }
@@ -410,11 +455,13 @@ std::vector<uint64_t> filesystem::inode_t::linearized_level3_pointers()
 {
     const auto level1 = get_inode_block_pointers();
     std::vector<uint64_t> block_pointers;
+    fs.prefetch_blocks(level1);
     for (const auto & lv1_blk : level1)
     {
         if (lv1_blk != 0)
         {
             const auto lv2_blks = get_pointer_by_block(lv1_blk);
+            fs.prefetch_blocks(lv2_blks);
             for (const auto & lv2_blk : lv2_blks)
             {
                 if (lv2_blk != 0)
@@ -434,6 +481,52 @@ std::vector<uint64_t> filesystem::inode_t::linearized_level3_pointers()
     return block_pointers;
 }
 
+std::vector<uint64_t> filesystem::inode_t::level3_pointers_by_position()
+{
+    // pointer blocks cover the file from its start without gaps, holes are null pointers inside them
+    const auto level1 = get_inode_block_pointers();
+    std::vector<uint64_t> block_pointers;
+    fs.prefetch_blocks(level1);
+    for (const auto & lv1_blk : level1)
+    {
+        if (lv1_blk != 0)
+        {
+            const auto lv2_blks = get_pointer_by_block(lv1_blk);
+            fs.prefetch_blocks(lv2_blks);
+            for (const auto & lv2_blk : lv2_blks)
+            {
+                if (lv2_blk != 0) {
+                    const auto lv3_blks = get_pointer_by_block(lv2_blk);
+                    block_pointers.insert(block_pointers.end(), lv3_blks.begin(), lv3_blks.end());
+                }
+            }
+        }
+    }
+
+    block_pointers.resize(ceil_div(unblocked_get_header().attributes.st_size, block_size));
+    return block_pointers;
+}
+
+void filesystem::inode_t::set_level3_pointer(const uint64_t position, const uint64_t data_field_block_id)
+{
+    const uint64_t level2_position = position / block_max_entries;
+    auto level1 = get_inode_block_pointers();
+    auto & lv1_blk = level1[level2_position / block_max_entries];
+    assert_short(lv1_blk != 0);
+    auto lv2_blks = get_pointer_by_block(lv1_blk);
+    auto & lv2_blk = lv2_blks[level2_position % block_max_entries];
+    assert_short(lv2_blk != 0);
+    auto lv3_blks = get_pointer_by_block(lv2_blk);
+    lv3_blks[position % block_max_entries] = data_field_block_id;
+
+    // frozen pointer blocks are copied, and the copy has to be linked in one level up
+    if (save_pointer_to_block_or_copy(lv2_blk, lv3_blks)
+        && save_pointer_to_block_or_copy(lv1_blk, lv2_blks))
+    {
+        save_inode_block_pointers(level1);
+    }
+}
+
 std::vector<uint64_t> filesystem::inode_t::linearized_level2_pointers()
 {
     const auto level1 = get_inode_block_pointers();
@@ -471,7 +564,7 @@ uint64_t filesystem::inode_t::read(void *buff, uint64_t size, const uint64_t off
         size = header.attributes.st_size - offset;
     }
 
-    const auto level3_blocks = linearized_level3_pointers();
+    const auto level3_blocks = level3_pointers_by_position();
 
     const uint64_t first_blk_position = offset / block_size;
     const uint64_t first_blk_offset = offset % block_size;
@@ -481,20 +574,34 @@ uint64_t filesystem::inode_t::read(void *buff, uint64_t size, const uint64_t off
     const uint64_t last_blk_position = first_blk_position + continuous_blks + 1;
     const uint64_t last_blk_read_size = (size - first_blk_read_size) % block_size;
 
+    if (size != 0) {
+        fs.readahead(inode_id, level3_blocks, first_blk_position, (offset + size - 1) / block_size);
+    }
+
+    auto read_block = [&](const uint64_t position, void * dest, const uint64_t read_size, const uint64_t in_block_offset)
+    {
+        if (level3_blocks[position] == 0) { // hole
+            std::memset(dest, 0, read_size);
+            return;
+        }
+
+        fs.read_block(level3_blocks[position], dest, read_size, in_block_offset);
+    };
+
     uint64_t g_wr_off = 0;
     // 1. read first block
-    fs.read_block(level3_blocks[first_blk_position], buff, first_blk_read_size, first_blk_offset);
+    read_block(first_blk_position, buff, first_blk_read_size, first_blk_offset);
     g_wr_off += first_blk_read_size;
 
     // 2. read continuous blocks
     for (uint64_t i = 0; i < continuous_blks; i++) {
         const uint64_t blk_position = first_blk_position + 1 + i;
-        fs.read_block(level3_blocks[blk_position], static_cast<uint8_t *>(buff) + g_wr_off, block_size, 0);
+        read_block(blk_position, static_cast<uint8_t *>(buff) + g_wr_off, block_size, 0);
         g_wr_off += block_size;
     }
 
     if (last_blk_read_size) {
-        fs.read_block(level3_blocks[last_blk_position], static_cast<uint8_t *>(buff) + g_wr_off, last_blk_read_size, 0);
+        read_block(last_blk_position, static_cast<uint8_t *>(buff) + g_wr_off, last_blk_read_size, 0);
         g_wr_off += last_blk_read_size;
     }
     assert_short(g_wr_off == size);
@@ -503,6 +610,7 @@ uint64_t filesystem::inode_t::read(void *buff, uint64_t size, const uint64_t off
 
 uint64_t filesystem::inode_t::write(const void * buff, uint64_t size, const uint64_t offset)
 {
+    allocation_hint_scope_t allocation_hint_scope(fs, inode_id);
     auto header = unblocked_get_header();
 
     if (header.attributes.st_size == 0) {
@@ -520,7 +628,7 @@ uint64_t filesystem::inode_t::write(const void * buff, uint64_t size, const uint
     header.attributes.st_atim = header.attributes.st_ctim = header.attributes.st_mtim = get_current_time();
     unblocked_save_header(header);
 
-    const auto level3_blocks = linearized_level3_pointers();
+    const auto level3_blocks = level3_pointers_by_position();
 
     const uint64_t first_blk_position = offset / block_size;
     const uint64_t first_blk_offset = offset % block_size;
@@ -564,21 +672,44 @@ uint64_t filesystem::inode_t::write(const void * buff, uint64_t size, const uint
         }
     };
 
+    // holes get a zeroed block, out of the reservation fallocate() made for them if there is one
+    auto target_block = [&](const uint64_t position)->uint64_t
+    {
+        if (level3_blocks[position] != 0) {
+            return block_redirect(level3_blocks[position]);
+        }
+
+        // the reserved block is given back before allocation, so it can be allocated,
+        // and reserved again if the hole cannot be filled
+        const bool reserved = fs.take_reservation(inode_id);
+        try {
+            level3 hole_block(fs, true, block_size, true);
+            set_level3_pointer(position, hole_block.data_field_block_id);
+            hole_block.control_active = false;
+            return hole_block.data_field_block_id;
+        } catch (...) {
+            if (reserved) {
+                fs.reserve_for_inode(inode_id, 1);
+            }
+            throw;
+        }
+    };
+
     uint64_t g_wr_off = 0;
     // 1. write the first block
-    const uint64_t target_first_block = block_redirect(level3_blocks[first_blk_position]);
+    const uint64_t target_first_block = target_block(first_blk_position);
     fs.write_block(target_first_block, buff, first_blk_write_size, first_blk_offset, false);
     g_wr_off += first_blk_write_size;
 
     // 2. write continuous blocks
     for (uint64_t i = 0; i < continuous_blks; i++) {
-        const uint64_t blk_position = block_redirect(level3_blocks[first_blk_position + 1 + i]);
+        const uint64_t blk_position = target_block(first_blk_position + 1 + i);
         fs.write_block(blk_position, static_cast<const uint8_t *>(buff) + g_wr_off, block_size, 0, false);
         g_wr_off += block_size;
     }
 
     if (last_blk_write_size) {
-        fs.write_block(block_redirect(level3_blocks[last_blk_position]), static_cast<const uint8_t *>(buff) + g_wr_off, last_blk_write_size, 0, false);
+        fs.write_block(target_block(last_blk_position), static_cast<const uint8_t *>(buff) + g_wr_off, last_blk_write_size, 0, false);
         g_wr_off += last_blk_write_size;
     }
 
@@ -724,6 +855,9 @@ uint64_t filesystem::directory_t::get_inode(const std::string & name)
                         fs.block_manager->set_attr(block, attr);
                     }
 
+                    // the reservation for holes is copied along with the inode block, and is only counted
+                    // for the duplicate, as frozen inodes have none
+
                     debug_log("Inode duplicated due to frozen inode, inode ", child, ", new inode ", new_inode, ", parent ", get_header().attributes.st_ino);
                     child = new_inode;
                     // update dentry
@@ -881,7 +1015,10 @@ filesystem::inode_t filesystem::directory_t::create_dentry(const std::string & n
 
     dentry_t dentry{};
     std::strncpy(dentry.name, name.c_str(), CFS_MAX_FILENAME_LENGTH - 1);
-    dentry.inode_id = fs.allocate_new_block();
+    {
+        allocation_hint_scope_t allocation_hint_scope(fs, inode_id);
+        dentry.inode_id = fs.allocate_new_block();
+    }
 
     // create new attribute
     constexpr cfs_blk_attr_t attr = {
@@ -31,11 +31,36 @@
     }                                                                                                                                       \
     block_manager->journal->push_action(actions::ACTION_TRANSACTION_DONE, action);
 
-filesystem::filesystem(const char * location)
+/// first read ahead window once reads turn sequential, doubled on every sequential read after,
+/// up to READAHEAD_MAX_WINDOW blocks or 1/8 of the block cache
+#define READAHEAD_INITIAL_WINDOW (4)
+#define READAHEAD_MAX_WINDOW (256)
+/// inodes whose read pattern is tracked, all are forgotten once exceeded
+#define READAHEAD_MAX_TRACKED_INODES (1024)
+
+filesystem::filesystem(const char * location, const mount_options_t & options)
 {
-    SIMPLE_OPERATION(basic_io.open(location), fs_error::cannot_open_disk);
-    SIMPLE_OPERATION(block_io = std::make_unique<block_io_t>(basic_io), fs_error::filesystem_block_mapping_init_error);
+    if (options.mmap && options.direct_io) {
+        warning_log("Direct IO cannot be used on a mapped disk, direct_io ignored");
+    }
+
+    SIMPLE_OPERATION(basic_io.open(location, options.io_uring ? basic_io_t::IO_URING : basic_io_t::SYNCHRONOUS_IO,
+        options.direct_io && !options.mmap), fs_error::cannot_open_disk);
+    if (options.mmap) {
+        SIMPLE_OPERATION(basic_io.map(), fs_error::cannot_open_disk);
+    }
+    SIMPLE_OPERATION(block_io = std::make_unique<block_io_t>(basic_io, false, options), fs_error::filesystem_block_mapping_init_error);
     SIMPLE_OPERATION(block_manager = std::make_unique<blk_manager>(*block_io), fs_error::filesystem_block_manager_init_error);
+    if (options.discard)
+    {
+        const uint64_t block_over_sector = block_manager->block_size / SECTOR_SIZE;
+        SIMPLE_OPERATION(discard_queue = std::make_unique<discard_queue_t>(basic_io,
+            block_manager->data_field_block_start * block_over_sector, block_over_sector),
+            fs_error::filesystem_block_manager_init_error);
+        block_manager->discard_queue = discard_queue.get();
+    }
+
+    reserve_blocks = block_manager->blk_count * std::min<uint64_t>(options.reserve, 100) / 100;
 }
 
 filesystem::~filesystem()
@@ -43,6 +68,10 @@ filesystem::~filesystem()
     try {
         block_manager.reset();
         block_io.reset();
+        if (discard_queue) {
+            discard_queue->commit(); // frees are on disk now
+            discard_queue.reset();
+        }
     } catch (runtime_error & e) {
         error_log("Error when unmounting: ", e.what());
     } catch (std::exception & e) {
@@ -52,60 +81,133 @@ filesystem::~filesystem()
     }
 }
 
-uint64_t filesystem::unblocked_allocate_new_block()
+void filesystem::preallocate_blocks(uint64_t count)
 {
-    uint64_t new_block_id = UINT64_MAX;
-    try {
-        new_block_id = block_manager->allocate_block();
-    } catch (...) { }
+    while (count != 0)
+    {
+        std::pair < uint64_t, uint64_t > extent;
+        try {
+            extent = block_manager->allocate_extent(1, count, allocation_hint);
+        } catch (blk_manager::no_space_available &) {
+            return;
+        }
+
+        // held as unlinked storage blocks until handed out, so they are neither counted free
+        // nor indexed as COW redundancy blocks for reclaim
+        const auto [start, length] = extent;
+        for (uint64_t i = start; i < start + length; i++)
+        {
+            block_manager->journal->push_action(actions::ACTION_TRANSACTION_ALLOCATE_BLOCK, i);
+            block_manager->set_attr(i, cfs_blk_attr_t{
+                .frozen = 0,
+                .type = STORAGE_TYPE,
+                .type_backup = 0,
+                .cow_refresh_count = 0,
+                .newly_allocated_thus_no_cow = 1,
+                .links = 0
+            });
+            preallocated_blocks.push_back(i);
+        }
 
-    if (new_block_id != UINT64_MAX) {
-        block_manager->journal->push_action(actions::ACTION_TRANSACTION_ALLOCATE_BLOCK, new_block_id);
+        count -= length;
     }
-    else
+}
+
+void filesystem::release_preallocated_blocks()
+{
+    // never written, nothing to keep a COW copy of
+    while (!preallocated_blocks.empty())
     {
-        try {
-            std::vector<std::pair<uint64_t, uint8_t>> cow_blocks; // COW blocks
-            for (uint64_t i = 0; i < block_manager->blk_count; i++)
-            {
-                if (!block_manager->block_allocated(i)) {
-                    continue;
-                }
+        block_manager->free_block(preallocated_blocks.front());
+        preallocated_blocks.pop_front();
+    }
+}
 
-                if (auto attr = block_manager->get_attr(i);
-                    attr.type == COW_REDUNDANCY_TYPE && !attr.frozen) // if type is COW
-                {
-                    if (attr.cow_refresh_count > 0) {
-                        attr.cow_refresh_count--; // count > 0? --
-                        block_manager->set_attr(i, attr); // update attributes
-                    }
-                    cow_blocks.emplace_back(i, static_cast<uint8_t>(attr.cow_refresh_count)); // put it on the list
-                }
-            }
+uint64_t filesystem::reservation_of(const uint64_t inode_id)
+{
+    if (get_attr(inode_id).frozen) {
+        return 0;
+    }
 
-            if (cow_blocks.empty()) {
-                throw fs_error::filesystem_space_depleted(""); // no COW blocks, no space then
-            }
+    inode_t::inode_reservation_t reservation{};
+    read_block(inode_id, &reservation, sizeof(reservation), sizeof(inode_t::inode_header_t));
+    return reservation.generation == block_manager->reservation_generation() ? reservation.blocks : 0;
+}
 
-            std::ranges::sort(cow_blocks, [](const std::pair<uint64_t, uint8_t> & lhs, const std::pair<uint64_t, uint8_t> & rhs)->bool {
-                return lhs.second < rhs.second;
-            }); // sort it
+void filesystem::set_reservation(const uint64_t inode_id, const uint64_t count)
+{
+    const inode_t::inode_reservation_t reservation {
+        .blocks = count,
+        .generation = block_manager->reservation_generation(),
+    };
+    // no COW copy, it would be allocated out of the very blocks just given back for a hole
+    write_block(inode_id, &reservation, sizeof(reservation), sizeof(inode_t::inode_header_t), false);
+}
 
-            int lowest_refresh_count = INT_MAX;
-            for (const auto & refresh : cow_blocks | std::views::values) {
-                if (lowest_refresh_count > refresh) {
-                    lowest_refresh_count = refresh;
-                }
-            }
+void filesystem::reserve_for_inode(const uint64_t inode_id, const uint64_t count)
+{
+    if (count == 0) {
+        return;
+    }
 
-            for (const auto & [id, refresh] : cow_blocks) {
-                if (refresh <= lowest_refresh_count) {
-                    block_manager->free_block(id);
-                }
+    while (block_manager->free_blocks() < count) {
+        if (block_manager->reclaim_cow_blocks() == 0) {
+            throw fs_error::filesystem_space_depleted("Cannot reserve " + std::to_string(count) + " blocks");
+        }
+    }
+
+    block_manager->reserve(count);
+    set_reservation(inode_id, reservation_of(inode_id) + count);
+}
+
+bool filesystem::take_reservation(const uint64_t inode_id)
+{
+    const uint64_t reserved = reservation_of(inode_id);
+    if (reserved == 0) {
+        return false;
+    }
+
+    cap_reservation(inode_id, reserved - 1);
+    return true;
+}
+
+void filesystem::cap_reservation(const uint64_t inode_id, const uint64_t max)
+{
+    const uint64_t reserved = reservation_of(inode_id);
+    if (reserved <= max) {
+        return;
+    }
+
+    block_manager->release_reserved(reserved - max);
+    set_reservation(inode_id, max);
+}
+
+uint64_t filesystem::unblocked_allocate_new_block()
+{
+    uint64_t new_block_id = UINT64_MAX;
+    if (!preallocated_blocks.empty()) {
+        new_block_id = preallocated_blocks.front(); // journaled when preallocated
+        preallocated_blocks.pop_front();
+    } else {
+        try {
+            new_block_id = block_manager->allocate_block(allocation_hint);
+        } catch (...) { }
+
+        if (new_block_id != UINT64_MAX) {
+            block_manager->journal->push_action(actions::ACTION_TRANSACTION_ALLOCATE_BLOCK, new_block_id);
+        }
+    }
+
+    if (new_block_id == UINT64_MAX)
+    {
+        try {
+            // free the COW blocks with the lowest refresh count
+            if (block_manager->reclaim_cow_blocks() == 0) {
+                throw fs_error::filesystem_space_depleted(""); // no COW blocks, no space then
             }
 
             try { // try again
-                new_block_id = block_manager->allocate_block();
+                new_block_id = block_manager->allocate_block(allocation_hint);
                 block_manager->journal->push_action(actions::ACTION_TRANSACTION_ALLOCATE_BLOCK, new_block_id);
             } catch (...) {
                 // WTF???
@@ -176,6 +278,53 @@ void filesystem::unblocked_deallocate_block(const uint64_t data_field_block_id)
     }
 }
 
+void filesystem::prefetch_blocks(const std::vector < uint64_t > & data_field_block_ids)
+{
+    std::vector < uint64_t > indices;
+    indices.reserve(data_field_block_ids.size());
+    for (const auto data_field_block_id : data_field_block_ids)
+    {
+        if (data_field_block_id != 0 && data_field_block_id < block_manager->blk_count) {
+            indices.push_back(block_manager->data_field_block_start + data_field_block_id);
+        }
+    }
+
+    if (indices.size() > 1) {
+        block_io->prefetch(indices);
+    }
+}
+
+void filesystem::readahead(const uint64_t inode_id, const std::vector < uint64_t > & level3_blocks,
+    const uint64_t first_block, const uint64_t last_block)
+{
+    if (readahead_states.size() >= READAHEAD_MAX_TRACKED_INODES && !readahead_states.contains(inode_id)) {
+        readahead_states.clear();
+    }
+
+    auto & [next_block, window, prefetched_until] = readahead_states[inode_id];
+    const uint64_t max_window = std::clamp<uint64_t>(block_io->cache_capacity() / 8, 1, READAHEAD_MAX_WINDOW);
+    if (first_block == next_block) {
+        // continues where the last read stopped, a read from the start of file counts as well
+        window = window == 0 ? std::min<uint64_t>(READAHEAD_INITIAL_WINDOW, max_window) : std::min(window * 2, max_window);
+    } else {
+        window = 0;
+        prefetched_until = 0;
+    }
+    next_block = last_block + 1;
+
+    // blocks of the read itself always go out as one batch, and read ahead is topped up
+    // once the reader is within half a window of its end
+    uint64_t end = std::min<uint64_t>(next_block, level3_blocks.size());
+    if (window != 0 && prefetched_until < next_block + window / 2) {
+        end = std::min<uint64_t>(next_block + window, level3_blocks.size());
+        prefetched_until = end;
+    }
+
+    if (first_block < end) {
+        prefetch_blocks({ level3_blocks.begin() + static_cast<int64_t>(first_block), level3_blocks.begin() + static_cast<int64_t>(end) });
+    }
+}
+
 uint64_t filesystem::unblocked_read_block(const uint64_t data_field_block_id, void * buff, uint64_t size, const uint64_t offset)
 {
     if (offset > block_manager->block_size) return 0;
@@ -436,43 +585,46 @@ void filesystem::set_attr(const uint64_t data_field_block_id, const cfs_blk_attr
 void filesystem::freeze_block()
 {
     ACTION_START_NO_ARGS(actions::ACTION_FREEZE_BLOCK)
-    for (uint64_t i = 1; i < block_manager->blk_count; i++) // 0 not freezable
-    {
-        if (block_manager->block_allocated(i))
-        {
-            if (auto attr = block_manager->get_attr(i);
-                !attr.frozen && attr.type != COW_REDUNDANCY_TYPE)
-            {
-                attr.frozen = 1;
-                attr.links++;
-                block_manager->set_attr(i, attr);
-            }
-        }
-    }
+    block_manager->freeze_data_blocks(); // 0 not freezable
     ACTION_END(actions::ACTION_FREEZE_BLOCK)
 }
 
 void filesystem::sync()
 {
+    block_manager->flush();
     block_io->sync();
+    if (discard_queue) {
+        discard_queue->commit();
+    }
 }
 
-struct statvfs filesystem::fstat()
+void filesystem::fsync(const uint64_t inode_id)
 {
-    uint64_t allocated = 0;
-    for (uint64_t i = 0; i < block_manager->blk_count; i++)
-    {
-        if (block_manager->block_allocated(i))
-        {
-            if (const auto attr = block_manager->get_attr(i);
-                attr.type != COW_REDUNDANCY_TYPE)
-            {
-                allocated++;
-            }
-        }
+    // map blocks are shared, flushing allocations of other inodes without their pointer blocks
+    // would persist half of their change. sync everything instead
+    if (!block_manager->changes_only_from(inode_id)) {
+        sync();
+        return;
     }
 
-    const auto free = block_manager->blk_count - allocated;
+    block_manager->flush();
+    block_io->sync_owner(inode_id);
+}
+
+void filesystem::drop_caches()
+{
+    block_manager->flush();
+    block_io->drop_caches();
+    if (discard_queue) {
+        discard_queue->commit();
+    }
+}
+
+struct statvfs filesystem::fstat()
+{
+    const uint64_t allocated = block_manager->allocated_blocks() - block_manager->allocated_cow_blocks();
+
+    const auto free = block_manager->blk_count - allocated - block_manager->reserved();
 
     const struct statvfs ret = {
         .f_bsize = block_manager->block_size,
@@ -492,17 +644,19 @@ struct statvfs filesystem::fstat()
     return ret;
 }
 
+bool filesystem::reclaim_reserve_round()
+{
+    if (block_manager->free_blocks() >= reserve_blocks) {
+        return false;
+    }
+
+    return block_manager->reclaim_cow_blocks() != 0;
+}
+
 void filesystem::reset()
 {
     ACTION_START_NO_ARGS(actions::ACTION_RESET_FROM_SNAPSHOT);
-    for (uint64_t i = 1; i < block_manager->blk_count; i++)
-    {
-        if (const auto attr = block_manager->get_attr(i);
-            !attr.frozen && attr.type != COW_REDUNDANCY_TYPE)
-        {
-            // discard ALL changes
-            block_manager->free_block(i);
-        }
-    }
+    block_manager->drop_reservations(); // inode blocks go back to states with reservations not counted any more
+    block_manager->free_data_blocks(); // discard ALL changes
     ACTION_END(actions::ACTION_RESET_FROM_SNAPSHOT);
 }
@@ -20,13 +20,117 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <climits>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
 #include "core/basic_io.h"
+#include "core/io_uring.h"
+#include "core/cfs.h"
 #include "helper/cpp_assert.h"
 #include "helper/err_type.h"
+#include "helper/log.h"
 
-void basic_io_t::open(const char *file_name)
+#define IO_URING_QUEUE_DEPTH (128)
+
+namespace {
+    bool is_aligned(const void * pointer) {
+        return reinterpret_cast<uintptr_t>(pointer) % DIRECT_IO_ALIGNMENT == 0;
+    }
+
+    bool is_aligned(const iovec * vectors, const int vector_count)
+    {
+        for (int i = 0; i < vector_count; i++) {
+            if (!is_aligned(vectors[i].iov_base)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// aligned temporary buffer for direct IO on unaligned user buffers
+    std::unique_ptr < uint8_t, decltype(&std::free) > make_bounce_buffer(const uint64_t length)
+    {
+        auto * buffer = static_cast<uint8_t *>(std::aligned_alloc(DIRECT_IO_ALIGNMENT,
+            ceil_div(length, DIRECT_IO_ALIGNMENT) * DIRECT_IO_ALIGNMENT));
+        if (buffer == nullptr) {
+            throw std::bad_alloc();
+        }
+        return { buffer, &std::free };
+    }
+
+    /// total bytes described by an IO vector list
+    uint64_t vector_length(const iovec * vectors, const int vector_count)
+    {
+        uint64_t length = 0;
+        for (int i = 0; i < vector_count; i++) {
+            assert_short(vectors[i].iov_len % 512 == 0);
+            length += vectors[i].iov_len;
+        }
+        return length;
+    }
+
+    /// run preadv/pwritev until all vectors are transferred, resuming on short transfers and splitting at IOV_MAX
+    /// @return bytes transferred, or -errno
+    template < typename SyscallType >
+    int64_t vectored_io(const int fd, std::vector < iovec > pending, uint64_t offset, SyscallType syscall)
+    {
+        iovec * head = pending.data();
+        int remaining = static_cast<int>(pending.size());
+        int64_t transferred = 0;
+        while (remaining > 0)
+        {
+            const auto ret = syscall(fd, head, std::min(remaining, IOV_MAX), static_cast<off_t>(offset));
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if (ret <= 0) {
+                return ret == 0 ? -EIO : -errno;
+            }
+
+            offset += ret;
+            transferred += ret;
+            auto done = static_cast<uint64_t>(ret);
+            while (remaining > 0 && done >= head->iov_len) {
+                done -= head->iov_len;
+                head++;
+                remaining--;
+            }
+
+            if (done) {
+                head->iov_base = static_cast<uint8_t *>(head->iov_base) + done;
+                head->iov_len -= done;
+            }
+        }
+
+        return transferred;
+    }
+}
+
+basic_io_t::basic_io_t() = default;
+
+basic_io_t::~basic_io_t()
+{
+    close();
+}
+
+void basic_io_t::open(const char *file_name, const backend_t backend, const bool direct)
 {
-    fd = ::open(file_name, /* O_DIRECT | */ O_RDWR /* | O_DSYNC | O_LARGEFILE | O_NOATIME | O_SYNC */);
+    direct_io = direct;
+    fd = ::open(file_name, (direct ? O_DIRECT : 0) | O_RDWR /* | O_DSYNC | O_LARGEFILE | O_NOATIME | O_SYNC */);
+    if (fd == -1 && direct && errno == EINVAL) {
+        warning_log("Direct IO is not supported on ", file_name, ", falling back to buffered IO");
+        direct_io = false;
+        fd = ::open(file_name, O_RDWR);
+    }
     flock lk = {
         .l_type   = F_WRLCK,   // write lock
         .l_whence = SEEK_SET,  // lock the whole file
@@ -36,14 +140,33 @@ void basic_io_t::open(const char *file_name)
     };
     assert_throw(fcntl(fd, F_SETLKW, &lk) != -1, "fcntl lock");
     assert_throw(fd != -1, "Error opening file");
+    struct stat file_stat{};
+    block_device = fstat(fd, &file_stat) == 0 && S_ISBLK(file_stat.st_mode);
     const uint64_t size = lseek(fd, 0, SEEK_END);
     assert_throw(size != static_cast<uint64_t>(-1), "Error getting size of file");
     file_sectors = size / 512;
+
+    if (backend == IO_URING)
+    {
+        try {
+            ring = std::make_unique<io_uring_t>(IO_URING_QUEUE_DEPTH);
+        } catch (const std::exception &) {
+            warning_log("io_uring is not available, falling back to synchronous IO");
+        }
+    }
 }
 
 void basic_io_t::close()
 {
     if (fd != -1) {
+        if (!queued.empty() || !in_flight.empty()) {
+            try { submit(); wait(); } catch (...) { }
+        }
+        ring.reset();
+        if (mapping != nullptr) {
+            munmap(mapping, file_sectors * 512);
+            mapping = nullptr;
+        }
         flock lk = {
             .l_type   = F_UNLCK,
             .l_whence = SEEK_SET,
@@ -59,20 +182,322 @@ void basic_io_t::close()
 
 void basic_io_t::read(sector_data_t & buffer, const sector_t sector) const
 {
-    if (sector >= file_sectors) {
+    read(buffer.data(), sector, 1);
+}
+
+void basic_io_t::write(const sector_data_t & buffer, const sector_t sector)
+{
+    write(buffer.data(), sector, 1);
+}
+
+void basic_io_t::read(uint8_t * buffer, const sector_t sector, const sector_t count) const
+{
+    if (sector + count > file_sectors) {
         throw runtime_error("Error reading sector");
     }
 
-    assert_short(lseek(fd, static_cast<long>(sector * 512), SEEK_SET) >= 0);
-    assert_short(::read(fd, buffer.data(), 512) == 512);
+    const uint64_t length = count * 512;
+    if (direct_io && !is_aligned(buffer))
+    {
+        const auto bounce = make_bounce_buffer(length);
+        read(bounce.get(), sector, count);
+        std::memcpy(buffer, bounce.get(), length);
+        return;
+    }
+
+    uint64_t done = 0;
+    while (done < length)
+    {
+        const auto ret = ::pread(fd, buffer + done, length - done, static_cast<off_t>(sector * 512 + done));
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+
+        assert_short(ret > 0);
+        done += ret;
+    }
 }
 
-void basic_io_t::write(const sector_data_t & buffer, const sector_t sector)
+void basic_io_t::write(const uint8_t * buffer, const sector_t sector, const sector_t count)
+{
+    if (sector + count > file_sectors) {
+        throw runtime_error("Error writing sector");
+    }
+
+    const uint64_t length = count * 512;
+    if (direct_io && !is_aligned(buffer))
+    {
+        const auto bounce = make_bounce_buffer(length);
+        std::memcpy(bounce.get(), buffer, length);
+        write(bounce.get(), sector, count);
+        return;
+    }
+
+    uint64_t done = 0;
+    while (done < length)
+    {
+        const auto ret = ::pwrite(fd, buffer + done, length - done, static_cast<off_t>(sector * 512 + done));
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+
+        assert_short(ret > 0);
+        done += ret;
+    }
+}
+
+void basic_io_t::readv(const iovec * vectors, const int vector_count, const sector_t sector) const
 {
-    if (sector >= file_sectors) {
+    const uint64_t length = vector_length(vectors, vector_count);
+    if (sector + length / 512 > file_sectors) {
         throw runtime_error("Error reading sector");
     }
 
-    assert_short(lseek(fd, static_cast<long>(sector * 512), SEEK_SET) >= 0);
-    assert_short(::write(fd, buffer.data(), 512) == 512);
+    if (direct_io && !is_aligned(vectors, vector_count))
+    {
+        const auto bounce = make_bounce_buffer(length);
+        read(bounce.get(), sector, length / 512);
+        for (uint64_t i = 0, offset = 0; i < static_cast<uint64_t>(vector_count); offset += vectors[i++].iov_len) {
+            std::memcpy(vectors[i].iov_base, bounce.get() + offset, vectors[i].iov_len);
+        }
+        return;
+    }
+
+    if (vectored_io(fd, { vectors, vectors + vector_count }, sector * 512, ::preadv) < 0) {
+        throw runtime_error("Error reading sector");
+    }
+}
+
+void basic_io_t::writev(const iovec * vectors, const int vector_count, const sector_t sector)
+{
+    const uint64_t length = vector_length(vectors, vector_count);
+    if (sector + length / 512 > file_sectors) {
+        throw runtime_error("Error writing sector");
+    }
+
+    if (direct_io && !is_aligned(vectors, vector_count))
+    {
+        const auto bounce = make_bounce_buffer(length);
+        for (uint64_t i = 0, offset = 0; i < static_cast<uint64_t>(vector_count); offset += vectors[i++].iov_len) {
+            std::memcpy(bounce.get() + offset, vectors[i].iov_base, vectors[i].iov_len);
+        }
+        write(bounce.get(), sector, length / 512);
+        return;
+    }
+
+    if (vectored_io(fd, { vectors, vectors + vector_count }, sector * 512, ::pwritev) < 0) {
+        throw runtime_error("Error writing sector");
+    }
+}
+
+uint8_t * basic_io_t::map()
+{
+    if (mapping != nullptr) {
+        return mapping;
+    }
+
+    assert_throw(!direct_io, "Direct IO disk cannot be mapped");
+    void * ret = mmap(nullptr, file_sectors * 512, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert_throw(ret != MAP_FAILED, "Error mapping file");
+    mapping = static_cast<uint8_t *>(ret);
+    return mapping;
+}
+
+void basic_io_t::sync_mapped(const sector_t sector, const sector_t count)
+{
+    assert_short(mapping != nullptr);
+    if (sector + count > file_sectors) {
+        throw runtime_error("Error writing sector");
+    }
+
+    // msync wants a page aligned start
+    static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t start = sector * 512 / page_size * page_size;
+    const uint64_t end = (sector + count) * 512;
+    if (msync(mapping + start, end - start, MS_SYNC) != 0) {
+        throw runtime_error("Error writing sector");
+    }
+}
+
+bool basic_io_t::discard(const sector_t sector, const sector_t count)
+{
+    if (sector + count > file_sectors) {
+        throw runtime_error("Error discarding sector");
+    }
+
+    if (block_device)
+    {
+        uint64_t range[2] = { sector * 512, count * 512 };
+        return ioctl(fd, BLKDISCARD, &range) == 0;
+    }
+
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        static_cast<off_t>(sector * 512), static_cast<off_t>(count * 512)) == 0;
+}
+
+void basic_io_t::queue_request(const bool write, const iovec * vectors, const int vector_count, const sector_t sector,
+    io_callback_t callback)
+{
+    const uint64_t length = vector_length(vectors, vector_count);
+    if (sector + length / 512 > file_sectors) {
+        throw runtime_error(write ? "Error writing sector" : "Error reading sector");
+    }
+
+    assert_short(vector_count <= IOV_MAX);
+    assert_short(!direct_io || is_aligned(vectors, vector_count));
+    queued.push_back({
+        .write = write,
+        .vectors = { vectors, vectors + vector_count },
+        .offset = sector * 512,
+        .remaining = length,
+        .result = 0,
+        .callback = std::move(callback),
+    });
+}
+
+void basic_io_t::queue_read(uint8_t * buffer, const sector_t sector, const sector_t count, io_callback_t callback)
+{
+    const iovec vector = { .iov_base = buffer, .iov_len = count * 512 };
+    queue_request(false, &vector, 1, sector, std::move(callback));
+}
+
+void basic_io_t::queue_write(const uint8_t * buffer, const sector_t sector, const sector_t count, io_callback_t callback)
+{
+    const iovec vector = { .iov_base = const_cast<uint8_t *>(buffer), .iov_len = count * 512 };
+    queue_request(true, &vector, 1, sector, std::move(callback));
+}
+
+void basic_io_t::queue_readv(const iovec * vectors, const int vector_count, const sector_t sector, io_callback_t callback)
+{
+    queue_request(false, vectors, vector_count, sector, std::move(callback));
+}
+
+void basic_io_t::queue_writev(const iovec * vectors, const int vector_count, const sector_t sector, io_callback_t callback)
+{
+    queue_request(true, vectors, vector_count, sector, std::move(callback));
+}
+
+void basic_io_t::prepare_submission(const uint64_t request_id, request_t & request)
+{
+    io_uring_sqe * sqe = ring->get_sqe();
+    while (sqe == nullptr) {
+        ring->submit();
+        reap_completion(true);
+        sqe = ring->get_sqe();
+    }
+
+    sqe->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(request.vectors.data());
+    sqe->len = static_cast<uint32_t>(request.vectors.size());
+    sqe->off = request.offset;
+    sqe->user_data = request_id;
+}
+
+void basic_io_t::reap_completion(const bool block)
+{
+    io_uring_cqe cqe{};
+    if (block) {
+        ring->wait(cqe);
+    } else if (!ring->peek(cqe)) {
+        return;
+    }
+
+    const auto it = in_flight.find(cqe.user_data);
+    assert_short(it != in_flight.end());
+    auto & request = it->second;
+    if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        prepare_submission(it->first, request); // retry as is
+        return;
+    }
+
+    if (cqe.res <= 0) {
+        request.result = cqe.res == 0 ? -EIO : cqe.res;
+    } else {
+        request.result += cqe.res;
+        request.remaining -= cqe.res;
+        if (request.remaining != 0)
+        {
+            // short transfer, resubmit the rest
+            auto done = static_cast<uint64_t>(cqe.res);
+            request.offset += done;
+            auto head = request.vectors.begin();
+            while (done >= head->iov_len) {
+                done -= head->iov_len;
+                ++head;
+            }
+            request.vectors.erase(request.vectors.begin(), head);
+            request.vectors.front().iov_base = static_cast<uint8_t *>(request.vectors.front().iov_base) + done;
+            request.vectors.front().iov_len -= done;
+            prepare_submission(it->first, request);
+            return;
+        }
+    }
+
+    completed.push_back(std::move(request));
+    in_flight.erase(it);
+}
+
+void basic_io_t::submit()
+{
+    if (!ring)
+    {
+        for (auto & request : queued)
+        {
+            const auto length = static_cast<int64_t>(request.remaining);
+            request.result = request.write
+                ? vectored_io(fd, request.vectors, request.offset, ::pwritev)
+                : vectored_io(fd, request.vectors, request.offset, ::preadv);
+            if (request.result >= 0 && request.result != length) {
+                request.result = -EIO;
+            }
+            completed.push_back(std::move(request));
+        }
+
+        queued.clear();
+        return;
+    }
+
+    for (auto & request : queued)
+    {
+        // keep completion queue from overflowing
+        while (in_flight.size() >= ring->entries()) {
+            ring->submit();
+            reap_completion(true);
+        }
+
+        const uint64_t request_id = next_request_id++;
+        auto & submitted = in_flight.emplace(request_id, std::move(request)).first->second;
+        prepare_submission(request_id, submitted);
+    }
+
+    queued.clear();
+    ring->submit();
+}
+
+void basic_io_t::wait()
+{
+    while (!in_flight.empty()) {
+        ring->submit();
+        reap_completion(true);
+    }
+
+    const request_t * failed = nullptr;
+    for (auto & request : completed)
+    {
+        if (request.callback) {
+            request.callback(request.result);
+        } else if (request.result < 0 && failed == nullptr) {
+            failed = &request;
+        }
+    }
+
+    if (failed != nullptr)
+    {
+        const bool failed_write = failed->write;
+        completed.clear();
+        throw runtime_error(failed_write ? "Error writing sector" : "Error reading sector");
+    }
+
+    completed.clear();
 }
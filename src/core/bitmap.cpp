@@ -18,69 +18,263 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <bit>
+#include <cstring>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#endif
 #include "core/bitmap.h"
 #include "core/crc64sum.h"
 #include "helper/cpp_assert.h"
 #include "helper/log.h"
 
-bitmap::bitmap(block_io_t & block_mapping_, const uint64_t map_start_, const uint64_t map_end_, const uint64_t boundary_, const uint64_t block_size_)
-    : block_mapping(block_mapping_), map_start(map_start_), map_end(map_end_), boundary(boundary_), blk_size(block_size_)
+bitmap::bitmap(block_io_t & block_mapping_, const uint64_t map_start_, const uint64_t map_end_, const uint64_t boundary_,
+    const uint64_t block_size_, const uint64_t mirror_start_)
+    : block_mapping(block_mapping_), map_start(map_start_), map_end(map_end_), boundary(boundary_), blk_size(block_size_),
+    mirror_start(mirror_start_)
 {
     assert_short(map_start_ < map_end_);
+    assert_short(blk_size % sizeof(uint64_t) == 0);
+    assert_short(ceil_div(boundary, 8) <= (map_end - map_start) * blk_size);
+
+    words.resize((map_end - map_start) * blk_size / sizeof(uint64_t));
+    block_dirty.resize(map_end - map_start, false);
+    block_checksums.resize(map_end - map_start, 0);
+    load(map_start);
 }
 
-bool bitmap::get(const uint64_t index)
+uint64_t bitmap::block_checksum(const uint64_t block_offset, const uint64_t * block_words) const
 {
-    assert_short(index < boundary);
-    const uint64_t byte_offset = index / 8;
-    const uint64_t bit_offset = index % 8;
-    const uint64_t block_offset = byte_offset / blk_size;
-    const uint64_t byte_in_block = byte_offset % blk_size;
-    assert_short(block_offset < (map_end - map_start));
-
-    // debug_log("Block: ", block_offset, ", Byte: ", byte_in_block, ", Bit: ", bit_offset);
-    auto desired_block = block_mapping.safe_at(block_offset + map_start);
-    uint8_t data;
-    desired_block->get(&data, 1, byte_in_block);
-    data >>= bit_offset;
-    const auto result = data & 0x01;
-    return result;
+    CRC64 hash;
+    hash.update(reinterpret_cast<const uint8_t *>(block_words), blk_size);
+    hash.update(reinterpret_cast<const uint8_t *>(&block_offset), sizeof(block_offset)); // same content elsewhere differs
+    return hash.get_checksum();
+}
+
+void bitmap::load(const uint64_t start)
+{
+    // map blocks are laid out little endian, byte i / 8 bit i % 8, so they load into words as they are
+    map_checksum = 0;
+    for (uint64_t i = 0; i < map_end - map_start; i++) {
+        auto desired_block = block_mapping.safe_at(i + start);
+        desired_block->get(reinterpret_cast<uint8_t *>(words.data() + i * blk_size / sizeof(uint64_t)), blk_size, 0);
+        block_checksums[i] = block_checksum(i, words.data() + i * blk_size / sizeof(uint64_t));
+        map_checksum ^= block_checksums[i];
+    }
+
+    // bits past boundary never count as free
+    const uint64_t group_count = ceil_div(boundary, BITMAP_GROUP_BITS);
+    group_free.assign(group_count, 0);
+    group_summary.assign(ceil_div(group_count, 64), 0);
+    free_bits = 0;
+    for (uint64_t word_index = 0; word_index < ceil_div(boundary, 64); word_index++)
+    {
+        const uint64_t valid_bits = std::min<uint64_t>(boundary - word_index * 64, 64);
+        const uint64_t valid_mask = valid_bits == 64 ? UINT64_MAX : (1ULL << valid_bits) - 1;
+        const auto clear_bits = static_cast<uint32_t>(std::popcount(~words[word_index] & valid_mask));
+        group_free[word_index * 64 / BITMAP_GROUP_BITS] += clear_bits;
+        free_bits += clear_bits;
+    }
+
+    for (uint64_t group = 0; group < group_count; group++) {
+        if (group_free[group] != 0) {
+            group_summary[group / 64] |= 1ULL << (group % 64);
+        }
+    }
+}
+
+bitmap::~bitmap()
+{
+    try {
+        flush();
+    } catch (std::exception & e) {
+        error_log("Cannot write allocation bitmap back: ", e.what());
+    }
 }
 
 void bitmap::set(const uint64_t index, const bool val)
 {
     assert_short(index < boundary);
-    const uint64_t byte_offset = index / 8;
-    const uint64_t bit_offset = index % 8;
-    const uint64_t block_offset = byte_offset / blk_size;
-    const uint64_t byte_in_block = byte_offset % blk_size;
-    assert_short(block_offset < (map_end - map_start));
-
-    // debug_log("Block: ", block_offset, ", Byte: ", byte_in_block, ", Bit: ", bit_offset);
-    auto desired_block = block_mapping.safe_at(block_offset + map_start);
-    uint8_t data;
-    desired_block->get(&data, 1, byte_in_block);
-    uint8_t comp = 0x01;
-    comp <<= bit_offset;
-    if (val) {
-        data |= comp;
-    } else {
-        data &= ~comp;
-    }
-    desired_block->update(&data, 1, byte_in_block);
-    // desired_block.sync();
+    const uint64_t comp = 1ULL << (index % 64);
+    uint64_t & word = words[index / 64];
+    if (val == static_cast<bool>(word & comp)) {
+        return;
+    }
+
+    word ^= comp;
+
+    const uint64_t group = index / BITMAP_GROUP_BITS;
+    if (val)
+    {
+        free_bits--;
+        if (--group_free[group] == 0) {
+            group_summary[group / 64] &= ~(1ULL << (group % 64));
+        }
+    }
+    else
+    {
+        free_bits++;
+        if (group_free[group]++ == 0) {
+            group_summary[group / 64] |= 1ULL << (group % 64);
+        }
+    }
+
+    if (const uint64_t owner = block_mapping.get_dirty_owner(); dirty_blocks.empty()) {
+        changes_owner = owner;
+    } else if (changes_owner != owner) {
+        changes_owner = NO_DIRTY_OWNER;
+    }
+
+    if (const uint64_t block_offset = index / 8 / blk_size; !block_dirty[block_offset]) {
+        block_dirty[block_offset] = true;
+        dirty_blocks.push_back(block_offset);
+    }
 }
 
-uint64_t bitmap::hash()
+uint64_t bitmap::scan_words(const uint64_t from, const uint64_t end) const
 {
-    CRC64 hash;
-    std::vector<uint8_t> data(blk_size);
+    const uint64_t word_end = ceil_div(end, 64);
+    uint64_t word_index = from / 64;
 
-    for (uint64_t i = map_start; i < map_end; i++) {
-        auto desired_block = block_mapping.safe_at(i);
-        desired_block->get(data.data(), blk_size, 0);
-        hash.update(data.data(), blk_size);
+    // first word, bits before `from` count as set
+    if (const uint64_t word = words[word_index] | ((1ULL << (from % 64)) - 1); word != UINT64_MAX) {
+        return std::min(word_index * 64 + std::countr_one(word), end);
     }
+    word_index++;
 
-    return hash.get_checksum();
+#if defined(__AVX2__)
+    // skip full words four at a time
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    while (word_index + 4 <= word_end
+        && _mm256_testc_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(words.data() + word_index)), ones))
+    {
+        word_index += 4;
+    }
+#endif
+
+    for (; word_index < word_end; word_index++)
+    {
+        if (words[word_index] != UINT64_MAX) {
+            return std::min(word_index * 64 + std::countr_one(words[word_index]), end);
+        }
+    }
+
+    return end;
+}
+
+uint64_t bitmap::next_free_group(const uint64_t group) const
+{
+    const uint64_t group_count = group_free.size();
+    if (group >= group_count) {
+        return group_count;
+    }
+
+    uint64_t summary_index = group / 64;
+    if (const uint64_t summary = group_summary[summary_index] & ~((1ULL << (group % 64)) - 1); summary != 0) {
+        return std::min(summary_index * 64 + std::countr_zero(summary), group_count);
+    }
+
+    for (summary_index++; summary_index < group_summary.size(); summary_index++)
+    {
+        if (group_summary[summary_index] != 0) {
+            return std::min(summary_index * 64 + std::countr_zero(group_summary[summary_index]), group_count);
+        }
+    }
+
+    return group_count;
+}
+
+uint64_t bitmap::find_zero(const uint64_t from) const
+{
+    if (from >= boundary) {
+        return boundary;
+    }
+
+    // rest of the group `from` is in, then straight to the next group with free space
+    const uint64_t group = from / BITMAP_GROUP_BITS;
+    if (group_free[group] != 0)
+    {
+        const uint64_t group_end = std::min((group + 1) * BITMAP_GROUP_BITS, boundary);
+        if (const uint64_t found = scan_words(from, group_end); found < group_end) {
+            return found;
+        }
+    }
+
+    const uint64_t next_group = next_free_group(group + 1);
+    if (next_group >= group_free.size()) {
+        return boundary;
+    }
+
+    const uint64_t group_start = next_group * BITMAP_GROUP_BITS;
+    const uint64_t found = scan_words(group_start, std::min(group_start + BITMAP_GROUP_BITS, boundary));
+    assert_short(found < boundary);
+    return found;
+}
+
+uint64_t bitmap::zero_run(const uint64_t from, const uint64_t max) const
+{
+    uint64_t index = from;
+    while (index < boundary && index - from < max)
+    {
+        const uint64_t bits_left_in_word = 64 - index % 64;
+        const uint64_t zeros = std::min<uint64_t>(std::countr_zero(words[index / 64] >> (index % 64)), bits_left_in_word);
+        index += zeros;
+        if (zeros < bits_left_in_word) {
+            break;
+        }
+    }
+
+    return std::min({ index, boundary, from + max }) - from;
+}
+
+void bitmap::flush()
+{
+    for (const uint64_t block_offset : dirty_blocks)
+    {
+        const uint64_t * block_words = words.data() + block_offset * blk_size / sizeof(uint64_t);
+        auto desired_block = block_mapping.safe_at(block_offset + map_start);
+        desired_block->update(reinterpret_cast<const uint8_t *>(block_words), blk_size, 0);
+        if (mirror_start != 0) {
+            auto mirror_block = block_mapping.safe_at(block_offset + mirror_start);
+            mirror_block->update(reinterpret_cast<const uint8_t *>(block_words), blk_size, 0);
+        }
+
+        map_checksum ^= block_checksums[block_offset];
+        block_checksums[block_offset] = block_checksum(block_offset, block_words);
+        map_checksum ^= block_checksums[block_offset];
+        block_dirty[block_offset] = false;
+    }
+
+    dirty_blocks.clear();
+}
+
+uint64_t bitmap::mirror_checksum()
+{
+    assert_short(mirror_start != 0);
+    std::vector < uint64_t > block_words(blk_size / sizeof(uint64_t));
+    uint64_t checksum = 0;
+    for (uint64_t i = 0; i < map_end - map_start; i++) {
+        auto mirror_block = block_mapping.safe_at(i + mirror_start);
+        mirror_block->get(reinterpret_cast<uint8_t *>(block_words.data()), blk_size, 0);
+        checksum ^= block_checksum(i, block_words.data());
+    }
+
+    return checksum;
+}
+
+void bitmap::load_mirror()
+{
+    assert_short(mirror_start != 0);
+    load(mirror_start);
+}
+
+void bitmap::mark_all_dirty()
+{
+    changes_owner = NO_DIRTY_OWNER;
+    for (uint64_t i = 0; i < map_end - map_start; i++) {
+        if (!block_dirty[i]) {
+            block_dirty[i] = true;
+            dirty_blocks.push_back(i);
+        }
+    }
 }
@@ -1,8 +1,91 @@
+#include <bit>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#endif
 #include "core/blk_manager.h"
 #include "helper/log.h"
 #include "helper/cpp_assert.h"
 
-cfs_head_t blk_manager::get_header()
+/// cfs_blk_attr_t fields as seen in its uint16_t form
+#define ATTR_FROZEN_MASK    static_cast<uint16_t>(0x0003)
+#define ATTR_TYPE_MASK      static_cast<uint16_t>(0x000C)
+#define ATTR_FREEZE_DELTA   static_cast<uint16_t>(0x0201) // frozen 0 -> 1, links + 1
+static_assert(std::bit_cast<uint16_t>(cfs_blk_attr_t{ .frozen = 3, .type = 0, .type_backup = 0,
+    .cow_refresh_count = 0, .newly_allocated_thus_no_cow = 0, .links = 0 }) == ATTR_FROZEN_MASK);
+static_assert(std::bit_cast<uint16_t>(cfs_blk_attr_t{ .frozen = 1, .type = 3, .type_backup = 0,
+    .cow_refresh_count = 0, .newly_allocated_thus_no_cow = 0, .links = 1 }) == (ATTR_TYPE_MASK | ATTR_FREEZE_DELTA));
+
+/*!
+ * @brief visit allocated blocks 16 at a time, skipping runs of 64 free blocks
+ * @param words Allocation bitmap words
+ * @param first First block visited, blocks before it count as free
+ * @param boundary Block count, blocks from it on count as free
+ * @param visitor Called as visitor(first block of the 16, allocation bits of the 16)
+ */
+template < typename Visitor >
+static void for_each_allocated_chunk(const uint64_t * words, const uint64_t first, const uint64_t boundary, Visitor && visitor)
+{
+    for (uint64_t word_index = first / 64; word_index < ceil_div(boundary, 64); word_index++)
+    {
+        uint64_t word = words[word_index];
+        if (word_index == first / 64) {
+            word &= UINT64_MAX << (first % 64);
+        }
+        if (boundary - word_index * 64 < 64) {
+            word &= (1ULL << (boundary - word_index * 64)) - 1;
+        }
+
+        for (uint64_t chunk = 0; word != 0; chunk++, word >>= 16) {
+            if (const auto bits = static_cast<uint16_t>(word); bits != 0) {
+                visitor(word_index * 64 + chunk * 16, bits);
+            }
+        }
+    }
+}
+
+#if defined(__AVX2__)
+/// 0xFFFF in every lane whose allocation bit is set
+static __m256i allocated_lanes(const uint16_t bits)
+{
+    const __m256i lane_bits = _mm256_setr_epi16(
+        0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+        0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, static_cast<short>(0x8000));
+    return _mm256_cmpeq_epi16(_mm256_and_si256(_mm256_set1_epi16(static_cast<short>(bits)), lane_bits), lane_bits);
+}
+
+/// 0xFFFF in every lane whose entry is COW redundancy
+static __m256i cow_lanes(const __m256i attr) {
+    return _mm256_cmpeq_epi16(_mm256_and_si256(attr, _mm256_set1_epi16(ATTR_TYPE_MASK)), _mm256_setzero_si256());
+}
+
+/// 0xFFFF in every lane holding a data block, out of 16 entries and their allocation bits
+static __m256i data_lanes(const uint16_t * entries, const uint16_t bits)
+{
+    const __m256i attr = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entries));
+    const __m256i not_frozen = _mm256_cmpeq_epi16(_mm256_and_si256(attr, _mm256_set1_epi16(ATTR_FROZEN_MASK)),
+        _mm256_setzero_si256());
+    return _mm256_andnot_si256(cow_lanes(attr), _mm256_and_si256(allocated_lanes(bits), not_frozen));
+}
+
+/// one bit per lane, out of a lane mask
+static uint32_t lane_mask(const __m256i lanes) {
+    return static_cast<uint32_t>(_mm256_movemask_epi8(lanes)) & 0x55555555;
+}
+
+// unit tests turn SIMD scans off to compare them with the scalar ones
+# if defined(__UNIT_TEST_SUIT_ACTIVE__)
+#  define SIMD_SCANS (!scalar_scans)
+# else
+#  define SIMD_SCANS true
+# endif
+#endif
+
+/// entry belongs to a data block, if the block is allocated
+static bool data_attr(const uint16_t attr) {
+    return (attr & ATTR_FROZEN_MASK) == 0 && (attr & ATTR_TYPE_MASK) != 0;
+}
+
+cfs_head_t blk_manager::read_header()
 {
     cfs_head_t head{};
     auto head_blk = blk_mapping.safe_at(0);
@@ -10,29 +93,168 @@ cfs_head_t blk_manager::get_header()
     return head;
 }
 
+/// checksum guarding the usage counters of a header
+static uint64_t usage_checksum(const cfs_head_t & head)
+{
+    const uint64_t counters[] = { head.usage_info.cow_blocks, head.usage_info.frozen_blocks };
+    return hashcrc64(counters);
+}
+
+static uint64_t reservation_checksum(const cfs_head_t & head)
+{
+    const uint64_t fields[] = { head.reservation_info.blocks, head.reservation_info.generation };
+    return hashcrc64(fields);
+}
+
+cfs_head_t blk_manager::get_header()
+{
+    auto head = read_header();
+    head.runtime_info.allocated_blocks = allocated_blocks();
+    head.runtime_info.last_allocated_block = last_allocated_block;
+    head.usage_info.cow_blocks = cow_blocks;
+    head.usage_info.frozen_blocks = frozen_blocks;
+    head.usage_info.checksum = usage_checksum(head);
+    head.bitmap_info.checksum = block_bitmap->checksum();
+    head.bitmap_info.checksum_guard = hashcrc64(head.bitmap_info.checksum);
+    head.reservation_info.blocks = reserved_blocks;
+    head.reservation_info.generation = reservation_generation_;
+    head.reservation_info.checksum = reservation_checksum(head);
+    return head;
+}
+
+bool blk_manager::verify_bitmap_mirror(const cfs_head_t & header, const bool dirty_on_mount)
+{
+    assert_short(header.static_info.data_bitmap_end - header.static_info.data_bitmap_start
+        == header.static_info.data_bitmap_backup_end - header.static_info.data_bitmap_backup_start);
+
+    // no checksum written yet, the mirror is brought in line at the next sync point
+    if (header.bitmap_info.checksum_guard != hashcrc64(header.bitmap_info.checksum)) {
+        return false;
+    }
+
+    const uint64_t expected = header.bitmap_info.checksum;
+    const bool map_matches = block_bitmap->checksum() == expected;
+    const bool mirror_matches = block_bitmap->mirror_checksum() == expected;
+    if (map_matches && mirror_matches) {
+        return true;
+    }
+
+    if (map_matches) {
+        warning_log("Allocation bitmap mirror does not match checksum, rewritten from bitmap");
+    } else if (mirror_matches) {
+        warning_log("Allocation bitmap does not match checksum, restored from mirror");
+        block_bitmap->load_mirror();
+    } else if (!dirty_on_mount) {
+        // both off is expected when a sync point was interrupted, the bitmap is kept as before
+        warning_log("Allocation bitmap and mirror do not match checksum, mirror rewritten from bitmap");
+    }
+
+    return false;
+}
+
+void blk_manager::count_usage(const uint16_t attr, const int64_t delta)
+{
+    if ((attr & ATTR_TYPE_MASK) == 0) {
+        cow_blocks += delta;
+    }
+
+    if (attr & ATTR_FROZEN_MASK) {
+        frozen_blocks += delta;
+    }
+
+    runtime_info_dirty = true;
+}
+
 void blk_manager::bitset(const uint64_t index, const bool value)
 {
+    if (static_cast<bool>(bitget(index)) != value) {
+        count_usage(block_attr->get(index), value ? 1 : -1);
+    }
+
     block_bitmap->set(index, value);
-    block_bitmap_mirror->set(index, value);
+    if (value && discard_queue) {
+        discard_queue->cancel(index); // block is in use again
+    }
+    cow_index_update(index);
+}
+
+void blk_manager::cow_index_update(const uint64_t index)
+{
+    cow_expiry.erase(index);
+    if (!bitget(index)) {
+        return;
+    }
+
+    const auto attr = get_attr(index);
+    if (attr.type != COW_REDUNDANCY_TYPE || attr.frozen) {
+        return;
+    }
+
+    const uint64_t expiry = cow_epoch + attr.cow_refresh_count;
+    cow_expiry[index] = expiry;
+    cow_buckets[expiry].push_back(index);
+    cow_bucket_entries++;
+
+    // drop stale entries once they outnumber live ones
+    if (cow_bucket_entries > 2 * cow_expiry.size() + 1024)
+    {
+        cow_buckets.clear();
+        for (const auto & [block, block_expiry] : cow_expiry) {
+            cow_buckets[block_expiry].push_back(block);
+        }
+        cow_bucket_entries = cow_expiry.size();
+    }
+}
+
+uint64_t blk_manager::reclaim_cow_blocks()
+{
+    cow_epoch++;
+
+    // blocks past their expiry all have zero rounds left and form the lowest tier together,
+    // otherwise the lowest tier is the first bucket holding a live block
+    uint64_t freed = 0;
+    while (!cow_buckets.empty())
+    {
+        auto bucket = cow_buckets.begin();
+        const uint64_t expiry = bucket->first;
+        if (expiry > cow_epoch && freed != 0) {
+            break;
+        }
+
+        const auto blocks = std::move(bucket->second);
+        cow_buckets.erase(bucket);
+        cow_bucket_entries -= blocks.size();
+        for (const uint64_t block : blocks)
+        {
+            if (const auto it = cow_expiry.find(block); it != cow_expiry.end() && it->second == expiry) {
+                free_block(block);
+                freed++;
+            }
+        }
+    }
+
+    return freed;
 }
 
 blk_manager::blk_manager(block_io_t & block_io)
     : blk_mapping(block_io)
 {
-    auto header = get_header();
+    const auto header = read_header();
+    last_allocated_block = header.runtime_info.last_allocated_block;
     journal = std::make_unique<journaling>(block_io);
     *(uint64_t*)&blk_count = header.static_info.data_table_end - header.static_info.data_table_start;
     *(uint64_t*)&block_size = header.static_info.block_size;
+    group_cursors.resize(ceil_div(blk_count, BITMAP_GROUP_BITS), UINT64_MAX);
     block_bitmap = std::make_unique<bitmap>(
         block_io,
         header.static_info.data_bitmap_start, header.static_info.data_bitmap_end,
         blk_count,
-        header.static_info.block_size);
-    block_bitmap_mirror = std::make_unique<bitmap>(
-        block_io,
-        header.static_info.data_bitmap_backup_start, header.static_info.data_bitmap_backup_end,
-        blk_count,
-        header.static_info.block_size);
+        header.static_info.block_size,
+        header.static_info.data_bitmap_backup_start);
+    const bool bitmap_stale = !verify_bitmap_mirror(header, block_io.filesystem_dirty_on_mount());
+    if (bitmap_stale && !block_io.read_only()) {
+        block_bitmap->mark_all_dirty();
+    }
     block_attr = std::make_unique<block_attr_t>(
         block_io,
         header.static_info.block_size,
@@ -40,37 +262,137 @@ blk_manager::blk_manager(block_io_t & block_io)
         header.static_info.data_block_attribute_table_end,
         blk_count);
 
+    // index reclaimable COW redundancy blocks, and count usage
+    const uint16_t * entries = block_attr->raw_entries();
+    for_each_allocated_chunk(block_bitmap->raw_words(), 0, blk_count, [&](const uint64_t base, const uint16_t bits)
+    {
+        for (uint64_t i = 0; i < 16; i++)
+        {
+            if (bits >> i & 1)
+            {
+                count_usage(entries[base + i], 1);
+                if ((entries[base + i] & (ATTR_FROZEN_MASK | ATTR_TYPE_MASK)) == 0) {
+                    cow_index_update(base + i);
+                }
+            }
+        }
+    });
+
+    // counters written at the last sync point should agree, unless the filesystem was not unmounted cleanly.
+    // counters missing or off are written back at the next sync point
+    const bool counters_valid = header.usage_info.checksum == usage_checksum(header);
+    const bool counters_agree = counters_valid && header.usage_info.cow_blocks == cow_blocks
+        && header.usage_info.frozen_blocks == frozen_blocks && header.runtime_info.allocated_blocks == allocated_blocks();
+    if (counters_valid && !counters_agree && !block_io.filesystem_dirty_on_mount()) {
+        warning_log("Usage counters in header do not match allocation state, recounted");
+    }
+    runtime_info_dirty = !block_io.read_only() && (!counters_agree || bitmap_stale);
+
+    // after an unclean unmount, reservations recorded in inode blocks may not add up to the total any more.
+    // they are all dropped by moving on to a new generation
+    if (header.reservation_info.checksum == reservation_checksum(header) && !block_io.filesystem_dirty_on_mount()) {
+        reserved_blocks = std::min(header.reservation_info.blocks, block_bitmap->free_count());
+        reservation_generation_ = header.reservation_info.generation;
+    } else {
+        reservation_generation_ = header.reservation_info.generation + 1;
+        runtime_info_dirty = !block_io.read_only();
+    }
+
     *(uint64_t*)&data_field_block_start = header.static_info.data_table_start;
     *(uint64_t*)&data_field_block_end = header.static_info.data_table_end;
 }
 
-uint64_t blk_manager::allocate_block()
+blk_manager::~blk_manager()
+{
+    try {
+        flush();
+    } catch (std::exception & e) {
+        error_log("Cannot write allocation state back: ", e.what());
+    }
+}
+
+uint64_t blk_manager::allocate_block(const uint64_t hint)
+{
+    return allocate_extent(1, 1, hint).first;
+}
+
+void blk_manager::reserve(const uint64_t count)
 {
-    uint64_t last_alloc_blk = 0;
-    auto header = get_header();
-    if (header.runtime_info.allocated_blocks == blk_count) {
+    if (free_blocks() < count) {
         throw no_space_available();
     }
-    last_alloc_blk = header.runtime_info.last_allocated_block;
-    header.runtime_info.last_allocated_block = last_alloc_blk;
-    bool searched_through = false;
-    while (bitget(last_alloc_blk))
+
+    reserved_blocks += count;
+    runtime_info_dirty = true;
+}
+
+void blk_manager::release_reserved(const uint64_t count)
+{
+    assert_short(count <= reserved_blocks);
+    reserved_blocks -= count;
+    runtime_info_dirty = true;
+}
+
+void blk_manager::drop_reservations()
+{
+    reserved_blocks = 0;
+    reservation_generation_++;
+    runtime_info_dirty = true;
+}
+
+std::pair < uint64_t, uint64_t > blk_manager::allocate_extent(const uint64_t min, uint64_t max, const uint64_t hint)
+{
+    assert_short(min >= 1 && min <= max);
+    if (free_blocks() < min) {
+        throw no_space_available();
+    }
+    max = std::min(max, free_blocks()); // leave reserved blocks alone
+
+    // first fit, from last allocated block to the end, then from the start up to where the search began
+    uint64_t search_start = std::min(last_allocated_block, blk_count);
+    if (hint < blk_count)
     {
-        last_alloc_blk++;
-        if (last_alloc_blk >= blk_count && !searched_through) {
-            last_alloc_blk = 0;
-            searched_through = true;
-        } else if (last_alloc_blk >= blk_count && searched_through) {
-            throw no_space_available();
+        const uint64_t cursor = group_cursors[hint / BITMAP_GROUP_BITS];
+        search_start = cursor < blk_count ? cursor : hint;
+    }
+
+    uint64_t position = search_start;
+    bool wrapped = false;
+    uint64_t start = 0, length = 0;
+    while (true)
+    {
+        const uint64_t candidate = block_bitmap->find_zero(position);
+        if (candidate >= blk_count || (wrapped && candidate >= search_start))
+        {
+            if (wrapped || search_start == 0) {
+                throw no_space_available();
+            }
+
+            wrapped = true;
+            position = 0;
+            continue;
+        }
+
+        if (const uint64_t run = block_bitmap->zero_run(candidate, max); run >= min)
+        {
+            start = candidate;
+            length = run;
+            break;
+        } else {
+            position = candidate + run;
         }
     }
 
-    bitset(last_alloc_blk, true);
+    for (uint64_t i = start; i < start + length; i++) {
+        bitset(i, true);
+    }
 
-    header.runtime_info.last_allocated_block = last_alloc_blk;
-    header.runtime_info.allocated_blocks++;
-    blk_mapping.update_runtime_info(header);
-    return last_alloc_blk;
+    last_allocated_block = start + length - 1;
+    if (hint < blk_count) {
+        group_cursors[hint / BITMAP_GROUP_BITS] = start + length;
+    }
+    runtime_info_dirty = true;
+    return { start, length };
 }
 
 void blk_manager::free_block(const uint64_t block)
@@ -78,13 +400,84 @@ void blk_manager::free_block(const uint64_t block)
     if (bitget(block))
     {
         bitset(block, false);
+        runtime_info_dirty = true;
+        if (discard_queue) {
+            discard_queue->push(block);
+        }
+    }
+}
 
-        auto header = get_header();
-        header.runtime_info.allocated_blocks--;
-        blk_mapping.update_runtime_info(header);
+void blk_manager::flush()
+{
+    block_bitmap->flush();
+    block_attr->flush();
+    if (runtime_info_dirty) {
+        blk_mapping.update_runtime_info(get_header());
+        runtime_info_dirty = false;
     }
 }
 
+void blk_manager::freeze_data_blocks()
+{
+    runtime_info_dirty = true;
+    uint16_t * entries = block_attr->raw_entries();
+    for_each_allocated_chunk(block_bitmap->raw_words(), 1, blk_count, [&](const uint64_t base, const uint16_t bits)
+    {
+#if defined(__AVX2__)
+        if (SIMD_SCANS)
+        {
+            const __m256i selected = data_lanes(entries + base, bits);
+            if (_mm256_testz_si256(selected, selected)) {
+                return;
+            }
+
+            auto * lanes = reinterpret_cast<__m256i *>(entries + base);
+            _mm256_storeu_si256(lanes, _mm256_add_epi16(_mm256_loadu_si256(lanes),
+                _mm256_and_si256(selected, _mm256_set1_epi16(ATTR_FREEZE_DELTA))));
+            block_attr->mark_dirty(base, 16);
+            frozen_blocks += std::popcount(lane_mask(selected));
+            return;
+        }
+#endif
+        bool changed = false;
+        for (uint64_t i = 0; i < 16; i++)
+        {
+            if ((bits >> i & 1) && data_attr(entries[base + i])) {
+                entries[base + i] += ATTR_FREEZE_DELTA;
+                frozen_blocks++;
+                changed = true;
+            }
+        }
+
+        if (changed) {
+            block_attr->mark_dirty(base, 16);
+        }
+    });
+}
+
+void blk_manager::free_data_blocks()
+{
+    // a word of the bitmap is read before its blocks are visited, so blocks can be freed during the scan
+    const uint16_t * entries = block_attr->raw_entries();
+    for_each_allocated_chunk(block_bitmap->raw_words(), 1, blk_count, [&](const uint64_t base, const uint16_t bits)
+    {
+#if defined(__AVX2__)
+        if (SIMD_SCANS)
+        {
+            for (uint32_t lanes = lane_mask(data_lanes(entries + base, bits)); lanes != 0; lanes &= lanes - 1) {
+                free_block(base + std::countr_zero(lanes) / 2);
+            }
+            return;
+        }
+#endif
+        for (uint64_t i = 0; i < 16; i++) {
+            if ((bits >> i & 1) && data_attr(entries[base + i])) {
+                free_block(base + i);
+            }
+        }
+    });
+}
+
 cfs_blk_attr_t blk_manager::get_attr(const uint64_t index)
 {
     auto ret = block_attr->get(index);
@@ -93,5 +486,10 @@ cfs_blk_attr_t blk_manager::get_attr(const uint64_t index)
 
 void blk_manager::set_attr(const uint64_t index, const cfs_blk_attr_t val)
 {
+    if (bitget(index)) {
+        count_usage(block_attr->get(index), -1);
+        count_usage(*(uint16_t*)&val, 1);
+    }
     block_attr->set(index, *(uint16_t*)&val);
+    cow_index_update(index);
 }
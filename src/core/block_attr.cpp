@@ -1,5 +1,7 @@
 #include "core/block_attr.h"
+#include <cstring>
 #include "helper/cpp_assert.h"
+#include "helper/log.h"
 
 void block_attr_t::linear_write(const void * data, const uint64_t size, const uint64_t offset)
 {
@@ -66,19 +68,94 @@ void block_attr_t::linear_read(void * data, const uint64_t size, const uint64_t
     assert_short(g_wr_off == size);
 }
 
+block_attr_t::block_attr_t(block_io_t & io, const uint64_t block_size,
+    const uint64_t attr_region_start, const uint64_t attr_region_end, const uint64_t entries)
+    : io(io),
+    block_size(block_size),
+    attr_region_start(attr_region_start),
+    attr_region_end(attr_region_end),
+    entries(entries)
+{
+    assert_short(block_size % sizeof(uint16_t) == 0);
+    const uint64_t table_blocks = ceil_div(entries * sizeof(uint16_t), block_size);
+    table.resize(table_blocks * block_size / sizeof(uint16_t));
+    block_dirty.resize(table_blocks, false);
+    linear_read(table.data(), table_blocks * block_size, 0);
+}
+
+block_attr_t::~block_attr_t()
+{
+    try {
+        flush();
+    } catch (std::exception & e) {
+        error_log("Cannot write block attributes back: ", e.what());
+    }
+}
+
+void block_attr_t::check_range(const uint64_t first, const uint64_t count) const
+{
+    assert_short(first <= entries && count <= entries - first);
+}
+
+void block_attr_t::mark_dirty(const uint64_t first, const uint64_t count)
+{
+    if (const uint64_t owner = io.get_dirty_owner(); dirty_blocks.empty()) {
+        changes_owner = owner;
+    } else if (changes_owner != owner) {
+        changes_owner = NO_DIRTY_OWNER;
+    }
+
+    const uint64_t entries_per_block = block_size / sizeof(uint16_t);
+    for (uint64_t block_offset = first / entries_per_block;
+        block_offset <= (first + count - 1) / entries_per_block; block_offset++)
+    {
+        if (!block_dirty[block_offset]) {
+            block_dirty[block_offset] = true;
+            dirty_blocks.push_back(block_offset);
+        }
+    }
+}
 
-uint16_t block_attr_t::get(const uint64_t index)
+uint16_t block_attr_t::get(const uint64_t index) const
 {
     assert_short(index < entries);
-    const uint64_t offset = index * sizeof(uint16_t);
-    uint16_t result = 0;
-    linear_read(&result, sizeof(uint16_t), offset);
-    return result;
+    return table[index];
 }
 
 void block_attr_t::set(const uint64_t index, const uint16_t value)
 {
     assert_short(index < entries);
-    const uint64_t offset = index * sizeof(uint16_t);
-    linear_write(&value, sizeof(uint16_t), offset);
+    if (table[index] != value) {
+        table[index] = value;
+        mark_dirty(index, 1);
+    }
+}
+
+void block_attr_t::get_range(const uint64_t first, const uint64_t count, uint16_t * values) const
+{
+    check_range(first, count);
+    std::memcpy(values, table.data() + first, count * sizeof(uint16_t));
+}
+
+void block_attr_t::set_range(const uint64_t first, const uint64_t count, const uint16_t * values)
+{
+    check_range(first, count);
+    if (count == 0) {
+        return;
+    }
+
+    std::memcpy(table.data() + first, values, count * sizeof(uint16_t));
+    mark_dirty(first, count);
+}
+
+void block_attr_t::flush()
+{
+    const uint64_t entries_per_block = block_size / sizeof(uint16_t);
+    for (const uint64_t block_offset : dirty_blocks)
+    {
+        linear_write(table.data() + block_offset * entries_per_block, block_size, block_offset * block_size);
+        block_dirty[block_offset] = false;
+    }
+
+    dirty_blocks.clear();
 }
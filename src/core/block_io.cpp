@@ -1,9 +1,31 @@
 #include <sys/sysinfo.h>
+#include <climits>
 #include "core/block_io.h"
 #include "helper/log.h"
 #include "helper/cpp_assert.h"
 #include "core/crc64sum.h"
 
+#define MAPPED_CACHE_MAX_VIEWS (1024 * 1024)
+
+/// most blocks dropped per eviction, small enough to keep the miss that triggers it cheap,
+/// large enough for write-backs to be merged. never more than 1/8 of the cache
+#define EVICTION_BATCH (64)
+
+/// background write-back wakes up this often, and writes back every block dirty for longer than WRITEBACK_EXPIRE
+#define WRITEBACK_INTERVAL std::chrono::milliseconds(1000)
+#define WRITEBACK_EXPIRE (5000)
+/// percent of cache allowed dirty, write-back starts above the background ratio, writers wait above the dirty ratio
+#define DIRTY_BACKGROUND_RATIO (10)
+#define DIRTY_RATIO (40)
+/// most blocks written back before the cache lock is released
+#define WRITEBACK_BATCH (1024)
+
+static uint64_t steady_milliseconds()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 void block_io_t::filesystem_verification()
 {
     sector_data_t header_sector;
@@ -44,14 +66,10 @@ void block_io_t::unblocked_sync_header()
     end.not_in_use();
 }
 
-block_io_t::block_io_t(basic_io_t & io, const bool read_only_fs) : io(io)
+block_io_t::block_io_t(basic_io_t & io, const bool read_only_fs, const mount_options_t & options) : io(io)
 {
     this->read_only_fs = read_only_fs;
     filesystem_verification();
-    if (!read_only_fs) {
-        cfs_head.runtime_info.mount_timestamp = get_timestamp();
-        unblocked_sync_header();
-    }
 
     struct sysinfo info{};
     if (sysinfo(&info) != 0) {
@@ -64,27 +82,291 @@ block_io_t::block_io_t(basic_io_t & io, const bool read_only_fs) : io(io)
             64 * 1024 * 1024 / cfs_head.static_info.block_size);
     }
 
+    // a mapped block is only a view, keeping far more of them around costs no copy
+    if (io.get_mapping() != nullptr) {
+        max_cached_block_number = std::min<uint64_t>(cfs_head.static_info.blocks, MAPPED_CACHE_MAX_VIEWS);
+    }
+
     // debug_log("Cache size: ", max_cached_block_number, " blocks");
+    cache_policy = make_cache_policy(options.cache_policy, max_cached_block_number);
+    buffer_pool = std::make_unique<buffer_pool_t>(cfs_head.static_info.block_size,
+        io.get_mapping() == nullptr ? max_cached_block_number : 0, DIRECT_IO_ALIGNMENT, options.huge_pages);
+    block_slab = std::make_unique<buffer_pool_t>(sizeof(block_data_t), max_cached_block_number, alignof(block_data_t));
+
+    if (!read_only_fs) {
+        cfs_head.runtime_info.mount_timestamp = get_timestamp();
+        unblocked_sync_header();
+        writeback_thread = std::thread(&block_io_t::writeback_main, this);
+    }
 }
 
 block_io_t::~block_io_t()
 {
-    if (read_only_fs) return;
-    cfs_head.runtime_info.flags.clean = true;
-    unblocked_sync_header();
-    block_cache.clear(); // force free all cached blocks
+    if (writeback_thread.joinable())
+    {
+        {
+            std::lock_guard lock(cache_mutex);
+            writeback_stop = true;
+        }
+        writeback_condition.notify_all();
+        writeback_thread.join();
+    }
+
+    if (!read_only_fs)
+    {
+        cfs_head.runtime_info.flags.clean = true;
+        unblocked_sync_header();
+        unblocked_flush_all();
+    }
+    unblocked_clear_cache(); // force free all cached blocks
 }
 
 void block_io_t::update_runtime_info(const cfs_head_t head)
 {
     if (read_only_fs) throw read_only_filesystem();
+    std::lock_guard lock(cache_mutex);
     cfs_head.runtime_info = head.runtime_info;
+    cfs_head.usage_info = head.usage_info;
+    cfs_head.bitmap_info = head.bitmap_info;
+    cfs_head.reservation_info = head.reservation_info;
     unblocked_sync_header();
 }
 
-void block_io_t::sync()
+void block_io_t::unblocked_flush(std::vector < block_data_t * > & blocks)
+{
+    std::erase_if(blocks, [](const block_data_t * blk)->bool { return blk->read_only || !blk->out_of_sync; });
+    std::ranges::sort(blocks, [](const block_data_t * a, const block_data_t * b)->bool {
+        return a->block_sector_start < b->block_sector_start;
+    });
+
+    // blocks are cleaned before their run is written, a run that fails is dirtied again,
+    // so its blocks are not dropped unwritten on eviction later.
+    // every block is locked until its write completes, so update() never changes data_ under an in-flight write
+    std::vector < std::unique_lock < std::mutex > > locks;
+    locks.reserve(blocks.size());
+    std::vector < uint64_t > dirty_since(blocks.size());
+    std::vector < std::pair < uint64_t /* first */, uint64_t /* end */ > > runs;
+    auto dirty_again = [&](const uint64_t first, const uint64_t end)
+    {
+        for (uint64_t i = first; i < end; i++)
+        {
+            if (!blocks[i]->out_of_sync.exchange(true)) {
+                dirty_blocks++;
+            }
+            blocks[i]->dirty_since = dirty_since[i];
+        }
+    };
+
+    // every run is queued as one request (or synced in place when mapped), then all runs go out as a single batch
+    std::vector < uint64_t > failed_runs;
+    for (uint64_t i = 0; i < blocks.size();)
+    {
+        // collect a run of blocks continuous on disk
+        const uint64_t first = i;
+        const uint64_t run_start = blocks[i]->block_sector_start;
+        uint64_t run_end = run_start;
+        std::vector < iovec > vectors;
+        for (; i < blocks.size() && blocks[i]->block_sector_start == run_end && vectors.size() < IOV_MAX; i++)
+        {
+            locks.emplace_back(blocks[i]->data_mutex);
+            dirty_since[i] = blocks[i]->dirty_since;
+            if (blocks[i]->out_of_sync.exchange(false)) {
+                dirty_blocks--;
+            }
+            vectors.push_back({ .iov_base = blocks[i]->data_, .iov_len = blocks[i]->size() });
+            run_end = blocks[i]->block_sector_end;
+        }
+
+        const uint64_t run_id = runs.size();
+        runs.emplace_back(first, i);
+        if (io.get_mapping() != nullptr)
+        {
+            try {
+                io.sync_mapped(run_start, run_end - run_start);
+            } catch (...) {
+                dirty_again(first, i);
+                throw;
+            }
+        }
+        else
+        {
+            io.queue_writev(vectors.data(), static_cast<int>(vectors.size()), run_start,
+                [&failed_runs, run_id, length = (run_end - run_start) * SECTOR_SIZE](const int64_t result) {
+                    if (result != static_cast<int64_t>(length)) {
+                        failed_runs.push_back(run_id);
+                    }
+                });
+        }
+    }
+
+    try {
+        io.submit();
+        io.wait();
+    } catch (...) {
+        dirty_again(0, blocks.size());
+        throw;
+    }
+
+    for (const uint64_t run_id : failed_runs) {
+        dirty_again(runs[run_id].first, runs[run_id].second);
+    }
+
+    if (!failed_runs.empty()) {
+        throw runtime_error("Error writing sector");
+    }
+}
+
+void block_io_t::unblocked_flush_all()
+{
+    std::vector < block_data_t * > blocks;
+    blocks.reserve(block_cache.size());
+    block_cache.for_each([&blocks](uint64_t, block_data_t * data) { blocks.push_back(data); });
+    unblocked_flush(blocks);
+}
+
+bool block_io_t::evictable(const cache_node_t * node)
+{
+    return !static_cast<const block_data_t *>(node)->in_use;
+}
+
+void block_io_t::unblocked_evict()
+{
+    std::vector < cache_node_t * > victims;
+    cache_policy->select_victims(victims,
+        std::clamp<uint64_t>(max_cached_block_number / 8, 1, EVICTION_BATCH), evictable);
+
+    std::vector < block_data_t * > pending_for_write_back;
+    pending_for_write_back.reserve(victims.size());
+    for (cache_node_t * node : victims) {
+        pending_for_write_back.push_back(static_cast<block_data_t *>(node));
+    }
+    unblocked_flush(pending_for_write_back);
+
+    for (cache_node_t * node : victims) {
+        cache_policy->erase(node);
+        destroy_block(block_cache.erase(node->key));
+    }
+}
+
+block_io_t::block_data_t * block_io_t::make_block(const uint64_t index)
+{
+    auto * block_data = new (block_slab->acquire()) block_data_t(
+        *buffer_pool,
+        io.get_mapping() == nullptr ? nullptr
+            : io.get_mapping() + index * cfs_head.static_info.block_over_sector * SECTOR_SIZE,
+        index * cfs_head.static_info.block_over_sector,
+        (index + 1) * cfs_head.static_info.block_over_sector,
+        io,
+        *this);
+    block_data->key = index;
+    return block_data;
+}
+
+void block_io_t::destroy_block(block_data_t * block)
+{
+    block->~block_data_t();
+    block_slab->release(reinterpret_cast<uint8_t *>(block));
+}
+
+void block_io_t::unblocked_clear_cache()
 {
+    cache_policy->clear();
+    block_cache.for_each([this](uint64_t, block_data_t * data) { destroy_block(data); });
     block_cache.clear();
+}
+
+bool block_io_t::unblocked_writeback_round()
+{
+    const uint64_t background_limit = max_cached_block_number * DIRTY_BACKGROUND_RATIO / 100;
+    const uint64_t expire_before = steady_milliseconds() - WRITEBACK_EXPIRE;
+    std::vector < block_data_t * > dirty;
+    block_cache.for_each([&dirty](uint64_t, block_data_t * data) {
+        if (data->out_of_sync && !data->read_only) {
+            dirty.push_back(data);
+        }
+    });
+
+    // oldest first, every expired block goes, younger ones only while above background ratio
+    std::ranges::sort(dirty, [](const block_data_t * a, const block_data_t * b)->bool {
+        return a->dirty_since < b->dirty_since;
+    });
+    uint64_t count = 0;
+    while (count < dirty.size() && count < WRITEBACK_BATCH
+        && (dirty[count]->dirty_since <= expire_before || dirty.size() - count > background_limit))
+    {
+        count++;
+    }
+
+    if (count == 0) {
+        return false;
+    }
+
+    dirty.resize(count);
+    unblocked_flush(dirty);
+    return true;
+}
+
+void block_io_t::writeback_main()
+{
+    pthread_setname_np(pthread_self(), "cfs_writeback");
+    std::unique_lock lock(cache_mutex);
+    while (!writeback_stop)
+    {
+        writeback_condition.wait_for(lock, WRITEBACK_INTERVAL, [this] { return writeback_stop || writeback_kicked; });
+        writeback_kicked = false;
+        if (writeback_stop) {
+            break;
+        }
+
+        try
+        {
+            while (unblocked_writeback_round())
+            {
+                throttle_condition.notify_all();
+                // let filesystem threads through between batches
+                lock.unlock();
+                std::this_thread::yield();
+                lock.lock();
+                if (writeback_stop) {
+                    break;
+                }
+            }
+        } catch (std::exception & e) {
+            error_log("Error during background write-back: ", e.what());
+        }
+
+        throttle_condition.notify_all();
+    }
+}
+
+void block_io_t::sync()
+{
+    std::lock_guard lock(cache_mutex);
+    unblocked_flush_all();
+    if (!read_only_fs) {
+        unblocked_sync_header();
+    }
+}
+
+void block_io_t::sync_owner(const uint64_t owner)
+{
+    std::lock_guard lock(cache_mutex);
+    std::vector < block_data_t * > blocks;
+    block_cache.for_each([&](const uint64_t index, block_data_t * data) {
+        if (data->out_of_sync && (data->dirty_owner == owner || data->dirty_owner == NO_DIRTY_OWNER
+            || (index >= cfs_head.static_info.journal_start && index < cfs_head.static_info.journal_end)))
+        {
+            blocks.push_back(data);
+        }
+    });
+    unblocked_flush(blocks);
+}
+
+void block_io_t::drop_caches()
+{
+    std::lock_guard lock(cache_mutex);
+    unblocked_flush_all();
+    unblocked_clear_cache();
     if (!read_only_fs) {
         unblocked_sync_header();
     }
@@ -93,9 +375,8 @@ void block_io_t::sync()
 block_io_t::block_data_t & block_io_t::unblocked_at(const uint64_t index)
 {
     assert_short(index < cfs_head.static_info.blocks);
-    access_frequencies[index]++;
-    if (block_cache.contains(index)) {
-        auto & ret = *block_cache.at(index);
+    if (block_data_t * ret = block_cache.find(index))
+    {
         if (index == 0 || index == cfs_head.static_info.blocks - 1) {
             ret->read_only = true;
         } else {
@@ -105,46 +386,28 @@ block_io_t::block_data_t & block_io_t::unblocked_at(const uint64_t index)
         if (read_only_fs) ret->read_only = true;
 
         ret->in_use = true;
+        cache_policy->access(ret);
         return *ret;
     }
 
-    if (block_cache.size() >= max_cached_block_number)
-    {
-        std::vector < std::pair < uint64_t, uint64_t > > pending_for_deletion;
-        for (const auto &[id, data] : block_cache) {
-            if (!(*data)->in_use) {
-                pending_for_deletion.emplace_back(id, access_frequencies[id]);
-            }
-        }
-
-        std::ranges::sort(pending_for_deletion,
-            [](const std::pair < uint64_t, uint64_t > & a, const std::pair < uint64_t, uint64_t > & b)->bool {
-            return a.second < b.second;
-        });
-
-        pending_for_deletion.resize((pending_for_deletion.size() / 3) * 2);
-        for (const auto & cached_block : pending_for_deletion | std::views::keys) {
-            block_cache.erase(cached_block);
-            access_frequencies.erase(cached_block);
-        }
+    if (block_cache.size() >= max_cached_block_number) {
+        unblocked_evict();
     }
 
-    sector_data_t data_sector;
-    block_cache.emplace(index,
-        std::make_unique<block_data_ptr_t>(
-            cfs_head.static_info.block_size,
-            index * cfs_head.static_info.block_over_sector,
-            (index + 1) * cfs_head.static_info.block_over_sector,
-            io));
-
-    const auto & block_data = *block_cache.at(index);
-    block_data->data_.resize(cfs_head.static_info.block_size);
-    for (uint64_t i = 0; i < cfs_head.static_info.block_over_sector; i++)
+    auto * block_data = make_block(index);
+    if (!block_data->mapped)
     {
-        io.read(data_sector, index * cfs_head.static_info.block_over_sector + i);
-        std::memcpy(block_data->data_.data() + i * SECTOR_SIZE, data_sector.data(), SECTOR_SIZE);
+        try {
+            io.read(block_data->data_, block_data->block_sector_start, cfs_head.static_info.block_over_sector);
+        } catch (...) {
+            destroy_block(block_data);
+            throw;
+        }
     }
 
+    block_cache.insert(index, block_data);
+    cache_policy->insert(block_data);
+
     if (index == 0 || index == cfs_head.static_info.blocks - 1) {
         block_data->read_only = true;
     } else {
@@ -157,15 +420,116 @@ block_io_t::block_data_t & block_io_t::unblocked_at(const uint64_t index)
     return *block_data;
 }
 
-block_io_t::block_data_t & block_io_t::at(const uint64_t index)
+void block_io_t::prefetch(const std::vector < uint64_t > & indices)
 {
-    return unblocked_at(index);
+    // a mapped block is only a view, there is nothing to read ahead
+    if (io.get_mapping() != nullptr) {
+        return;
+    }
+
+    std::lock_guard lock(cache_mutex);
+    const uint64_t budget = std::max<uint64_t>(max_cached_block_number / 4, 1);
+    std::vector < block_data_t * > blocks;
+    for (const uint64_t index : indices)
+    {
+        if (blocks.size() >= budget) {
+            break;
+        }
+
+        // header blocks are never read ahead, they are read only and written through unblocked_sync_header()
+        if (index == 0 || index >= cfs_head.static_info.blocks - 1 || block_cache.contains(index)) {
+            continue;
+        }
+
+        if (block_cache.size() >= max_cached_block_number) {
+            unblocked_evict();
+        }
+
+        auto * block_data = make_block(index);
+        block_data->read_only = read_only_fs;
+        block_data->in_use = true; // keep eviction for later blocks of this batch off it
+        block_cache.insert(index, block_data);
+        cache_policy->insert(block_data);
+        blocks.push_back(block_data);
+    }
+
+    if (blocks.empty()) {
+        return;
+    }
+
+    std::ranges::sort(blocks, [](const block_data_t * a, const block_data_t * b)->bool {
+        return a->block_sector_start < b->block_sector_start;
+    });
+
+    // runs continuous on disk are read by one request each, all runs go out as a single batch
+    std::vector < uint64_t > failed_runs;
+    std::vector < std::pair < uint64_t /* first */, uint64_t /* end */ > > runs;
+    for (uint64_t i = 0; i < blocks.size();)
+    {
+        const uint64_t first = i;
+        const uint64_t run_start = blocks[i]->block_sector_start;
+        uint64_t run_end = run_start;
+        std::vector < iovec > vectors;
+        for (; i < blocks.size() && blocks[i]->block_sector_start == run_end && vectors.size() < IOV_MAX; i++)
+        {
+            vectors.push_back({ .iov_base = blocks[i]->data_, .iov_len = blocks[i]->size() });
+            run_end = blocks[i]->block_sector_end;
+        }
+
+        const uint64_t run_id = runs.size();
+        runs.emplace_back(first, i);
+        io.queue_readv(vectors.data(), static_cast<int>(vectors.size()), run_start,
+            [&failed_runs, run_id, length = (run_end - run_start) * SECTOR_SIZE](const int64_t result) {
+                if (result != static_cast<int64_t>(length)) {
+                    failed_runs.push_back(run_id);
+                }
+            });
+    }
+
+    io.submit();
+    io.wait();
+
+    // readahead is a hint, blocks that could not be read are dropped and read again on demand
+    for (const uint64_t run_id : failed_runs)
+    {
+        for (uint64_t i = runs[run_id].first; i < runs[run_id].second; i++)
+        {
+            cache_policy->erase(blocks[i]);
+            destroy_block(block_cache.erase(blocks[i]->key));
+            blocks[i] = nullptr;
+        }
+    }
+
+    for (block_data_t * block : blocks) {
+        if (block) block->in_use = false;
+    }
+}
+
+block_io_t::block_data_t & block_io_t::at(const uint64_t index, const bool get_as_read_only)
+{
+    std::unique_lock lock(cache_mutex);
+    if (writeback_thread.joinable() && dirty_blocks >= max_cached_block_number * DIRTY_RATIO / 100)
+    {
+        // throttle the writer until write-back brings dirty blocks back under background ratio.
+        // bounded, a failing disk must not hang the filesystem
+        writeback_kicked = true;
+        writeback_condition.notify_one();
+        throttle_condition.wait_for(lock, WRITEBACK_INTERVAL, [this] {
+            return writeback_stop || dirty_blocks <= max_cached_block_number * DIRTY_BACKGROUND_RATIO / 100;
+        });
+    }
+
+    auto & blk = unblocked_at(index);
+    if (get_as_read_only) {
+        blk.read_only = true; // write-back reads it under cache_mutex
+    }
+    return blk;
 }
 
 void block_io_t::block_data_t::get(uint8_t *buf, const size_t sz, const uint64_t in_blk_off)
 {
-    assert_short(in_blk_off + sz <= data_.size());
-    std::memcpy(buf, data_.data() + in_blk_off, sz);
+    assert_short(in_blk_off + sz <= size());
+    std::memcpy(buf, data_ + in_blk_off, sz);
 }
 
 void block_io_t::block_data_t::update(const uint8_t * new_data, const size_t new_size, const uint64_t in_block_offset)
@@ -174,22 +538,40 @@ void block_io_t::block_data_t::update(const uint8_t * new_data, const size_t new
         throw runtime_error("Read-only block " +
             std::to_string(this->block_sector_end / (this->block_sector_end - this->block_sector_start + 1)));
     }
-    assert_short(in_block_offset + new_size <= data_.size());
-    std::memcpy(data_.data() + in_block_offset, new_data, new_size);
-    out_of_sync = true;
+    assert_short(in_block_offset + new_size <= size());
+    std::lock_guard lock(data_mutex); // write-back must not read data_ halfway through
+    std::memcpy(data_ + in_block_offset, new_data, new_size);
+    if (!out_of_sync.exchange(true))
+    {
+        dirty_since = steady_milliseconds();
+        dirty_owner = mother.dirty_owner;
+        mother.dirty_blocks++;
+    } else if (dirty_owner != mother.dirty_owner) {
+        dirty_owner = NO_DIRTY_OWNER;
+    }
 }
 
 void block_io_t::block_data_t::sync()
 {
     if (read_only) return;
-    if (!out_of_sync) return;
-    for (uint64_t i = block_sector_start; i < block_sector_end; i++)
-    {
-        sector_data_t data_sector;
-        std::memcpy(data_sector.data(), data_.data() + SECTOR_SIZE * (i - block_sector_start), SECTOR_SIZE);
-        io.write(data_sector, i);
+    std::lock_guard lock(data_mutex);
+    const uint64_t since = dirty_since;
+    if (!out_of_sync.exchange(false)) return; // cleared first, see out_of_sync
+    mother.dirty_blocks--;
+    try {
+        if (mapped) {
+            io.sync_mapped(block_sector_start, block_sector_end - block_sector_start);
+        } else {
+            io.write(data_, block_sector_start, block_sector_end - block_sector_start);
+        }
+    } catch (...) {
+        // still not on disk
+        if (!out_of_sync.exchange(true)) {
+            mother.dirty_blocks++;
+        }
+        dirty_since = since;
+        throw;
     }
 
     // debug_log("Sync block (sector ", block_sector_start, " - ", block_sector_end, ")");
-    out_of_sync = false;
 }
@@ -0,0 +1,111 @@
+/* buffer_pool.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <cstdlib>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "core/buffer_pool.h"
+#include "core/cfs.h"
+#include "helper/cpp_assert.h"
+#include "helper/log.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024ULL)
+
+buffer_pool_t::buffer_pool_t(const uint64_t buffer_size, const uint64_t buffer_count, const uint64_t alignment,
+    const bool huge_pages)
+    : buffer_size(buffer_size),
+      buffer_stride(ceil_div(buffer_size, alignment) * alignment),
+      buffer_count(buffer_count),
+      alignment(alignment)
+{
+    if (buffer_count == 0) {
+        return;
+    }
+
+    // anonymous mappings are page aligned, and pages are only backed once touched
+    assert_short(alignment <= static_cast<uint64_t>(sysconf(_SC_PAGESIZE)));
+    region_size = buffer_stride * buffer_count;
+    void * mapped = MAP_FAILED;
+    if (huge_pages)
+    {
+        const uint64_t huge_size = ceil_div(region_size, HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+        // no MAP_NORESERVE here, hugetlb pages have to be reserved up front or touching them raises SIGBUS
+        mapped = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mapped != MAP_FAILED) {
+            region_size = huge_size;
+        } else {
+            verbose_log("No hugetlb pages reserved, falling back to transparent hugepages");
+        }
+    }
+
+    if (mapped == MAP_FAILED)
+    {
+        mapped = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapped == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+
+        if (huge_pages) {
+            madvise(mapped, region_size, MADV_HUGEPAGE);
+        }
+    }
+
+    region = static_cast<uint8_t *>(mapped);
+
+    free_buffers.reserve(buffer_count);
+    for (uint64_t i = buffer_count; i > 0; i--) {
+        free_buffers.push_back(region + (i - 1) * buffer_stride);
+    }
+}
+
+buffer_pool_t::~buffer_pool_t()
+{
+    if (region != nullptr) {
+        munmap(region, region_size);
+    }
+}
+
+uint8_t * buffer_pool_t::acquire()
+{
+    if (!free_buffers.empty())
+    {
+        uint8_t * buffer = free_buffers.back();
+        free_buffers.pop_back();
+        return buffer;
+    }
+
+    auto * buffer = static_cast<uint8_t *>(std::aligned_alloc(alignment, buffer_stride));
+    if (buffer == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return buffer;
+}
+
+void buffer_pool_t::release(uint8_t * buffer)
+{
+    if (buffer >= region && buffer < region + buffer_stride * buffer_count) {
+        free_buffers.push_back(buffer);
+    } else {
+        std::free(buffer);
+    }
+}
@@ -0,0 +1,275 @@
+/* cache_policy.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include "core/cache_policy.h"
+#include "helper/err_type.h"
+
+void cache_node_list_t::push_front(cache_node_t * node)
+{
+    node->prev = nullptr;
+    node->next = head_;
+    if (head_) head_->prev = node;
+    head_ = node;
+    if (!tail_) tail_ = node;
+    size_++;
+}
+
+void cache_node_list_t::unlink(cache_node_t * node)
+{
+    if (node->prev) node->prev->next = node->next;
+    else head_ = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else tail_ = node->prev;
+    node->prev = node->next = nullptr;
+    size_--;
+}
+
+namespace {
+    /// keys of recently evicted entries, no data attached
+    class ghost_list_t
+    {
+        std::list < uint64_t > order;       /// most recent first
+        std::unordered_map < uint64_t, std::list < uint64_t >::iterator > index;
+
+    public:
+        void push_front(const uint64_t key)
+        {
+            erase(key);
+            order.push_front(key);
+            index.emplace(key, order.begin());
+        }
+
+        bool erase(const uint64_t key)
+        {
+            const auto it = index.find(key);
+            if (it == index.end()) {
+                return false;
+            }
+            order.erase(it->second);
+            index.erase(it);
+            return true;
+        }
+
+        void pop_back()
+        {
+            index.erase(order.back());
+            order.pop_back();
+        }
+
+        [[nodiscard]] uint64_t size() const { return order.size(); }
+    };
+
+    /*!
+     * @brief walk from `from` towards the most recently used end, collect up to `count` evictable nodes
+     * @return node to continue from
+     */
+    cache_node_t * collect(cache_node_t * from, std::vector < cache_node_t * > & victims, uint64_t count,
+        const cache_policy_t::evictable_t evictable)
+    {
+        for (; from != nullptr && count != 0; from = from->prev)
+        {
+            if (evictable(from)) {
+                victims.push_back(from);
+                count--;
+            }
+        }
+        return from;
+    }
+
+    /// plain least recently used
+    class lru_policy_t final : public cache_policy_t
+    {
+        cache_node_list_t entries;
+
+    public:
+        using cache_policy_t::cache_policy_t;
+        void insert(cache_node_t * node) override { entries.push_front(node); }
+        void access(cache_node_t * node) override { entries.unlink(node); entries.push_front(node); }
+        void erase(cache_node_t * node) override { entries.unlink(node); }
+        void clear() override { entries.clear(); }
+
+        void select_victims(std::vector < cache_node_t * > & victims, const uint64_t count, const evictable_t evictable) override {
+            collect(entries.tail(), victims, count, evictable);
+        }
+    };
+
+    /// 2Q (Johnson & Shasha), entries seen once stay in a FIFO and only a re-reference promotes them to the main LRU,
+    /// so a single scan cannot push hot entries out
+    class two_queue_policy_t final : public cache_policy_t
+    {
+        enum : uint8_t { A1IN = 1, AM = 2 };
+        cache_node_list_t a1in;             /// seen once, FIFO
+        cache_node_list_t am;               /// seen more than once, LRU
+        ghost_list_t a1out;                 /// recently evicted from a1in
+
+        [[nodiscard]] uint64_t a1in_limit() const { return std::max<uint64_t>(capacity / 4, 1); }
+        [[nodiscard]] uint64_t a1out_limit() const { return std::max<uint64_t>(capacity / 2, 1); }
+
+    public:
+        using cache_policy_t::cache_policy_t;
+
+        void insert(cache_node_t * node) override
+        {
+            if (a1out.erase(node->key)) {
+                node->list = AM;
+                am.push_front(node);
+            } else {
+                node->list = A1IN;
+                a1in.push_front(node);
+            }
+        }
+
+        void access(cache_node_t * node) override
+        {
+            if (node->list == AM) {
+                am.unlink(node);
+                am.push_front(node);
+            }
+        }
+
+        void erase(cache_node_t * node) override
+        {
+            if (node->list == AM) {
+                am.unlink(node);
+                return;
+            }
+
+            a1in.unlink(node);
+            a1out.push_front(node->key);
+            while (a1out.size() > a1out_limit()) {
+                a1out.pop_back();
+            }
+        }
+
+        void clear() override { a1in.clear(); am.clear(); }
+
+        void select_victims(std::vector < cache_node_t * > & victims, const uint64_t count, const evictable_t evictable) override
+        {
+            const uint64_t start = victims.size();
+            const uint64_t a1in_excess = a1in.size() > a1in_limit() ? a1in.size() - a1in_limit() : 0;
+            cache_node_t * a1in_cursor = collect(a1in.tail(), victims, std::min(count, a1in_excess), evictable);
+            collect(am.tail(), victims, count - (victims.size() - start), evictable);
+            collect(a1in_cursor, victims, count - (victims.size() - start), evictable);
+        }
+    };
+
+    /// ARC (Megiddo & Modha), balances recency against frequency with a target size adapted from ghost hits
+    class arc_policy_t final : public cache_policy_t
+    {
+        enum : uint8_t { T1 = 1, T2 = 2 };
+        cache_node_list_t t1;               /// seen once recently
+        cache_node_list_t t2;               /// seen at least twice recently
+        ghost_list_t b1;                    /// recently evicted from t1
+        ghost_list_t b2;                    /// recently evicted from t2
+        uint64_t target_t1 = 0;             /// adaptive target size of t1 (p)
+
+        void trim_ghosts()
+        {
+            while (b1.size() != 0 && t1.size() + b1.size() > capacity) {
+                b1.pop_back();
+            }
+            while (b2.size() != 0 && t1.size() + t2.size() + b1.size() + b2.size() > 2 * capacity) {
+                b2.pop_back();
+            }
+        }
+
+    public:
+        using cache_policy_t::cache_policy_t;
+
+        void insert(cache_node_t * node) override
+        {
+            const uint64_t b1_size = b1.size(), b2_size = b2.size();
+            if (b1.erase(node->key)) {
+                target_t1 = std::min(capacity, target_t1 + std::max<uint64_t>(b2_size / b1_size, 1));
+                node->list = T2;
+                t2.push_front(node);
+            } else if (b2.erase(node->key)) {
+                const uint64_t delta = std::max<uint64_t>(b1_size / b2_size, 1);
+                target_t1 = target_t1 > delta ? target_t1 - delta : 0;
+                node->list = T2;
+                t2.push_front(node);
+            } else {
+                node->list = T1;
+                t1.push_front(node);
+            }
+
+            trim_ghosts();
+        }
+
+        void access(cache_node_t * node) override
+        {
+            (node->list == T1 ? t1 : t2).unlink(node);
+            node->list = T2;
+            t2.push_front(node);
+        }
+
+        void erase(cache_node_t * node) override
+        {
+            if (node->list == T1) {
+                t1.unlink(node);
+                b1.push_front(node->key);
+            } else {
+                t2.unlink(node);
+                b2.push_front(node->key);
+            }
+
+            trim_ghosts();
+        }
+
+        void clear() override { t1.clear(); t2.clear(); }
+
+        void select_victims(std::vector < cache_node_t * > & victims, const uint64_t count, const evictable_t evictable) override
+        {
+            cache_node_t * t1_cursor = t1.tail();
+            cache_node_t * t2_cursor = t2.tail();
+            uint64_t t1_size = t1.size();
+            for (uint64_t i = 0; i < count; i++)
+            {
+                // replace from t1 while it is above target, as ARC's REPLACE does
+                const bool from_t1 = t1_size > target_t1 || t2_cursor == nullptr;
+                auto & cursor = from_t1 ? t1_cursor : t2_cursor;
+                auto & other = from_t1 ? t2_cursor : t1_cursor;
+                const uint64_t before = victims.size();
+                cursor = collect(cursor, victims, 1, evictable);
+                if (victims.size() == before)
+                {
+                    other = collect(other, victims, 1, evictable);
+                    if (victims.size() == before) {
+                        return; // nothing evictable left
+                    }
+                    if (!from_t1) t1_size--;
+                } else if (from_t1) {
+                    t1_size--;
+                }
+            }
+        }
+    };
+}
+
+std::unique_ptr < cache_policy_t > make_cache_policy(const std::string & name, const uint64_t capacity)
+{
+    if (name == "lru") return std::make_unique<lru_policy_t>(capacity);
+    if (name == "2q") return std::make_unique<two_queue_policy_t>(capacity);
+    if (name == "arc") return std::make_unique<arc_policy_t>(capacity);
+    throw runtime_error("Unknown cache policy " + name);
+}
@@ -0,0 +1,117 @@
+/* discard_queue.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <vector>
+#include "core/discard_queue.h"
+#include "helper/log.h"
+
+/// most extents discarded before the lock is released to let allocations through
+#define DISCARD_EXTENTS_PER_ROUND (64)
+
+discard_queue_t::discard_queue_t(basic_io_t & io, const uint64_t data_field_sector_start, const uint64_t block_over_sector)
+    : io(io), data_field_sector_start(data_field_sector_start), block_over_sector(block_over_sector)
+{
+    worker = std::thread(&discard_queue_t::worker_main, this);
+}
+
+discard_queue_t::~discard_queue_t()
+{
+    {
+        std::lock_guard lock(mutex);
+        stop = true;
+    }
+    condition.notify_all();
+    worker.join();
+}
+
+void discard_queue_t::push(const uint64_t data_field_block_id)
+{
+    std::lock_guard lock(mutex);
+    if (!unsupported) {
+        freed.insert(data_field_block_id);
+    }
+}
+
+void discard_queue_t::cancel(const uint64_t data_field_block_id)
+{
+    std::lock_guard lock(mutex);
+    freed.erase(data_field_block_id);
+    ready.erase(data_field_block_id);
+}
+
+void discard_queue_t::commit()
+{
+    {
+        std::lock_guard lock(mutex);
+        if (freed.empty()) {
+            return;
+        }
+
+        ready.merge(freed);
+        freed.clear();
+    }
+    condition.notify_all();
+}
+
+void discard_queue_t::worker_main()
+{
+    pthread_setname_np(pthread_self(), "cfs_discard");
+    std::unique_lock lock(mutex);
+    while (true)
+    {
+        condition.wait(lock, [this] { return stop || !ready.empty(); });
+        if (ready.empty()) {
+            return; // stop requested and nothing left
+        }
+
+        // coalesce continuous blocks into extents
+        std::vector < std::pair < uint64_t /* start */, uint64_t /* length */ > > extents;
+        auto it = ready.begin();
+        while (it != ready.end() && extents.size() < DISCARD_EXTENTS_PER_ROUND)
+        {
+            if (!extents.empty() && extents.back().first + extents.back().second == *it) {
+                extents.back().second++;
+            } else {
+                extents.emplace_back(*it, 1);
+            }
+            it = ready.erase(it);
+        }
+
+        for (const auto & [start, length] : extents)
+        {
+            try
+            {
+                if (!io.discard(data_field_sector_start + start * block_over_sector, length * block_over_sector)) {
+                    warning_log("Backing storage does not support discard, freed blocks will no longer be discarded");
+                    unsupported = true;
+                    ready.clear();
+                    break;
+                }
+            } catch (std::exception & e) {
+                error_log("Error when discarding blocks: ", e.what());
+            }
+        }
+
+        // let allocations waiting on cancel() through between rounds
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+    }
+}
@@ -0,0 +1,160 @@
+/* io_uring.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include "core/io_uring.h"
+#include "helper/cpp_assert.h"
+#include "helper/err_type.h"
+
+io_uring_t::io_uring_t(const unsigned entries)
+{
+    io_uring_params params{};
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd < 0) {
+        throw runtime_error("io_uring_setup failed: " + std::string(strerror(errno)));
+    }
+
+    entries_ = params.sq_entries;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        ::close(ring_fd);
+        throw runtime_error("io_uring submission ring mapping failed");
+    }
+
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            munmap(sq_ring, sq_ring_size);
+            ::close(ring_fd);
+            throw runtime_error("io_uring completion ring mapping failed");
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+        sqes = nullptr;
+        if (cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        munmap(sq_ring, sq_ring_size);
+        ::close(ring_fd);
+        throw runtime_error("io_uring entry mapping failed");
+    }
+
+    auto * sq = static_cast<uint8_t *>(sq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_ring_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    auto * cq = static_cast<uint8_t *>(cq_ring);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_ring_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    sqe_tail = sqe_submitted = *sq_tail;
+}
+
+io_uring_t::~io_uring_t()
+{
+    if (sqes) munmap(sqes, sqes_size);
+    if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring) munmap(sq_ring, sq_ring_size);
+    if (ring_fd != -1) ::close(ring_fd);
+}
+
+io_uring_sqe * io_uring_t::get_sqe()
+{
+    const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sqe_tail - head >= entries_) {
+        return nullptr;
+    }
+
+    const unsigned index = sqe_tail & *sq_ring_mask;
+    sq_array[index] = index;
+    io_uring_sqe * sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe_tail++;
+    return sqe;
+}
+
+void io_uring_t::submit(const unsigned wait_nr)
+{
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = sqe_tail - sqe_submitted;
+    while (to_submit != 0 || wait_nr != 0)
+    {
+        const auto ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr,
+            wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+
+            throw runtime_error("io_uring_enter failed: " + std::string(strerror(errno)));
+        }
+
+        sqe_submitted += static_cast<unsigned>(ret);
+        to_submit -= static_cast<unsigned>(ret);
+        if (to_submit == 0) {
+            break;
+        }
+    }
+}
+
+bool io_uring_t::peek(io_uring_cqe & cqe)
+{
+    const unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    cqe = cqes[head & *cq_ring_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void io_uring_t::wait(io_uring_cqe & cqe)
+{
+    while (!peek(cqe))
+    {
+        const auto ret = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN) {
+            throw runtime_error("io_uring_enter failed: " + std::string(strerror(errno)));
+        }
+    }
+}
@@ -23,24 +23,114 @@
 
 #include <cstdint>
 #include <array>
+#include <map>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <sys/uio.h>
 
 /// sector index type
 using sector_t = unsigned long long int;
 using sector_data_t = std::array<uint8_t, 512>;
 
+/// buffer alignment required when opened for direct IO
+#define DIRECT_IO_ALIGNMENT (4096ULL)
+
+/// completion callback of a queued request, receives bytes transferred, or -errno on failure
+using io_callback_t = std::function<void(int64_t)>;
+
+class io_uring_t;
+
 /// basic IO using low-level system calls only
 class basic_io_t
 {
+public:
+    enum backend_t {
+        SYNCHRONOUS_IO, /// queued requests are carried out by preadv/pwritev on submit()
+        IO_URING,       /// queued requests are batched into io_uring submissions
+    };
+
+private:
+    /// queued read/write request
+    struct request_t {
+        bool write;
+        std::vector < iovec > vectors;      /// vectors not yet transferred
+        uint64_t offset;                    /// file offset of the first vector
+        uint64_t remaining;                 /// bytes not yet transferred
+        int64_t result;                     /// bytes transferred, or -errno
+        io_callback_t callback;
+    };
+
     int fd = -1; /// file descriptor
     sector_t file_sectors = 0; /// sector count, sector is always 512 bytes
+    bool direct_io = false; /// opened with O_DIRECT, unaligned buffers are bounced through aligned memory
+    uint8_t * mapping = nullptr; /// shared mapping of the whole file, see map()
+    bool block_device = false; /// file is a block device, not a regular image file
+    std::unique_ptr < io_uring_t > ring;    /// io_uring backend, empty when requests are carried out synchronously
+    std::vector < request_t > queued;       /// requests waiting for submit()
+    std::map < uint64_t, request_t > in_flight; /// submitted requests, by io_uring user data
+    std::vector < request_t > completed;    /// requests waiting for callbacks to be called in wait()
+    uint64_t next_request_id = 0;
+
+    void queue_request(bool write, const iovec * vectors, int vector_count, sector_t sector, io_callback_t callback);
+    void prepare_submission(uint64_t request_id, request_t & request);  /// put a request onto io_uring submission queue
+    void reap_completion(bool block);       /// collect one completion from io_uring
 
 public:
-    basic_io_t() = default;
-    ~basic_io_t() { close(); }
-    void open(const char *file_name);
+    basic_io_t();
+    ~basic_io_t();
+    /// open a disk image, `direct` bypasses host page cache (O_DIRECT) if the underlying filesystem supports it
+    void open(const char *file_name, backend_t backend = SYNCHRONOUS_IO, bool direct = false);
     void close();
     void read(sector_data_t & buffer, sector_t) const;
     void write(const sector_data_t &buffer, sector_t);
+
+    /// read `count` continuous sectors starting from `sector` in one call
+    void read(uint8_t * buffer, sector_t sector, sector_t count) const;
+
+    /// write `count` continuous sectors starting from `sector` in one call
+    void write(const uint8_t * buffer, sector_t sector, sector_t count);
+
+    /// scatter read, fill `vectors` (each a multiple of 512 bytes) from continuous sectors starting at `sector`
+    void readv(const iovec * vectors, int vector_count, sector_t sector) const;
+
+    /// gather write, flush `vectors` (each a multiple of 512 bytes) to continuous sectors starting at `sector`
+    void writev(const iovec * vectors, int vector_count, sector_t sector);
+
+    /// queued requests are not bounced, in direct IO mode their buffers must be aligned to DIRECT_IO_ALIGNMENT
+
+    /// queue a read of `count` continuous sectors, buffer must stay valid until completion
+    void queue_read(uint8_t * buffer, sector_t sector, sector_t count, io_callback_t callback = {});
+
+    /// queue a write of `count` continuous sectors, buffer must stay valid until completion
+    void queue_write(const uint8_t * buffer, sector_t sector, sector_t count, io_callback_t callback = {});
+
+    /// queue a scatter read, vector list is copied but buffers must stay valid until completion
+    void queue_readv(const iovec * vectors, int vector_count, sector_t sector, io_callback_t callback = {});
+
+    /// queue a gather write, vector list is copied but buffers must stay valid until completion
+    void queue_writev(const iovec * vectors, int vector_count, sector_t sector, io_callback_t callback = {});
+
+    /// submit every queued request as one batch
+    void submit();
+
+    /// wait until every submitted request is completed, then call completion callbacks.
+    /// throws if a request without a callback failed
+    void wait();
+
+    [[nodiscard]] backend_t get_backend() const { return ring ? IO_URING : SYNCHRONOUS_IO; }
+    /// map the whole file into memory (shared) and return its base, mapping lives until close()
+    uint8_t * map();
+
+    /// write back `count` sectors of the mapping starting at `sector` (msync)
+    void sync_mapped(sector_t sector, sector_t count);
+
+    /// tell backing storage `count` sectors starting at `sector` are no longer used.
+    /// punches a hole in image files, BLKDISCARD on block devices. returns false if unsupported
+    bool discard(sector_t sector, sector_t count);
+
+    [[nodiscard]] uint8_t * get_mapping() const { return mapping; }
+    [[nodiscard]] bool is_direct_io() const { return direct_io; }
     [[nodiscard]] sector_t get_file_sectors() const { return file_sectors; }
 };
 
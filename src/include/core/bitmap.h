@@ -21,22 +21,79 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <vector>
 #include "core/block_io.h"
 
+/// bits summarized by one free space index entry, 64 words
+#define BITMAP_GROUP_BITS (4096)
+
+/// allocation bitmap, kept resident as 64-bit words. changes reach the on-disk map blocks, and the mirror blocks
+/// if there is a mirror, on flush() only
 class bitmap {
     block_io_t & block_mapping;
     const uint64_t map_start;
     const uint64_t map_end;
     const uint64_t boundary;
     const uint64_t blk_size;
+    const uint64_t mirror_start;            /// first block of the mirror map, 0 if there is none
+    std::vector < uint64_t > words;         /// whole map, bit i of the map is bit (i % 64) of words[i / 64]
+    std::vector < bool > block_dirty;       /// map block changed since last flush, by block offset in map
+    std::vector < uint64_t > dirty_blocks;  /// offsets of changed map blocks
+    uint64_t changes_owner = NO_DIRTY_OWNER; /// inode every change since last flush was made for, see block_io_t::set_dirty_owner()
+    std::vector < uint64_t > block_checksums; /// per map block, as last loaded or flushed
+    uint64_t map_checksum = 0;              /// xor of block_checksums
+
+    /// CRC64 of one map block, salted with its offset so equal blocks at different offsets do not cancel out
+    [[nodiscard]] uint64_t block_checksum(uint64_t block_offset, const uint64_t * block_words) const;
+
+    /// read map blocks starting at `start` into words, rebuild checksums and the free space index
+    void load(uint64_t start);
+
+    /// free space index, rebuilt from words on load. bits are grouped by BITMAP_GROUP_BITS
+    std::vector < uint32_t > group_free;    /// clear bits in each group
+    std::vector < uint64_t > group_summary; /// bit g set if group g has a clear bit
+    uint64_t free_bits = 0;                 /// clear bits in whole map
+
+    /// first clear bit in [from, end), end if none. end never crosses a group
+    [[nodiscard]] uint64_t scan_words(uint64_t from, uint64_t end) const;
+
+    /// first group at or after `group` with a clear bit, group count if none
+    [[nodiscard]] uint64_t next_free_group(uint64_t group) const;
 
 public:
     explicit bitmap(block_io_t & block_mapping_,
         uint64_t map_start_, uint64_t map_end_, uint64_t boundary_ /* size, max index == size - 1 */,
-        uint64_t block_size_);
-    bool get(uint64_t);
+        uint64_t block_size_, uint64_t mirror_start_ = 0);
+    ~bitmap();                              /// flush
+    bitmap(const bitmap &) = delete;
+    bitmap & operator=(const bitmap &) = delete;
+
+    bool get(const uint64_t index) const {
+        return (words[index / 64] >> (index % 64)) & 0x01;
+    }
+
     void set(uint64_t, bool);
-    uint64_t hash();
+
+    /// first clear bit at or after `from`, boundary if every bit from there on is set
+    [[nodiscard]] uint64_t find_zero(uint64_t from) const;
+
+    /// length of the run of clear bits starting at `from`, counted up to `max`
+    [[nodiscard]] uint64_t zero_run(uint64_t from, uint64_t max) const;
+
+    [[nodiscard]] uint64_t free_count() const { return free_bits; } /// clear bits below boundary
+    [[nodiscard]] const uint64_t * raw_words() const { return words.data(); } /// resident words, read only
+
+    void flush();                           /// write changed words back to map blocks, and mirror blocks, in cache
+
+    /// no change since last flush, or every change was made for inode `owner`
+    [[nodiscard]] bool changes_only_from(const uint64_t owner) const {
+        return dirty_blocks.empty() || changes_owner == owner;
+    }
+
+    [[nodiscard]] uint64_t checksum() const { return map_checksum; } /// checksum of the map as of the last flush
+    [[nodiscard]] uint64_t mirror_checksum();   /// checksum of the mirror blocks as they are now
+    void load_mirror();                     /// replace the map with the mirror, in memory only
+    void mark_all_dirty();                  /// rewrite every map block, and its mirror, on next flush
 };
 
 #endif //BITMAP_H
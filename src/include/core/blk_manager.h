@@ -2,9 +2,12 @@
 #define BLK_MANAGER_T_H
 
 #include <memory>
+#include <map>
+#include <unordered_map>
 #include "core/journal.h"
 #include "core/bitmap.h"
 #include "core/block_attr.h"
+#include "core/discard_queue.h"
 
 class filesystem;
 
@@ -13,6 +16,7 @@ class blk_manager
 {
 private:
     block_io_t & blk_mapping;                       /// block mapping
+    discard_queue_t * discard_queue = nullptr;      /// freed blocks are discarded through this, if set
 
 public:
     const uint64_t blk_count = 0;                   /// block count
@@ -22,12 +26,43 @@ public:
 
 private:
     std::unique_ptr < journaling > journal;         /// journaling
-    std::unique_ptr < bitmap > block_bitmap;        /// bitmap
-    std::unique_ptr < bitmap > block_bitmap_mirror; /// bitmap mirror
+    std::unique_ptr < bitmap > block_bitmap;        /// bitmap, written to its mirror region as well on flush
     std::unique_ptr < block_attr_t > block_attr;    /// block attributes
 
+    /// allocation counters live here and reach the header on flush(), not on every allocation.
+    /// allocated block count is the bitmap's, cow_blocks and frozen_blocks count allocated blocks only
+    uint64_t last_allocated_block = 0;
+    std::vector < uint64_t > group_cursors; /// per allocation group (bitmap group), where hinted allocation resumes. UINT64_MAX if none yet
+    uint64_t cow_blocks = 0;
+    uint64_t frozen_blocks = 0;
+    bool runtime_info_dirty = false;
+
+    /// free blocks promised and not yet allocated, see reserve(). reloaded from the header after a clean unmount
+    uint64_t reserved_blocks = 0;
+    uint64_t reservation_generation_ = 0;   /// see reservation_generation()
+
+    /// count an allocated block with attributes `attr` in (delta = 1) or out (delta = -1) of the usage counters
+    void count_usage(uint16_t attr, int64_t delta);
+
+    cfs_head_t read_header();   /// read header from disk as is
+
+    /// check bitmap and its mirror against the checksum in the header, restoring the bitmap from the mirror
+    /// if only the mirror matches. false if either is off, or no checksum was written yet
+    bool verify_bitmap_mirror(const cfs_head_t & header, bool dirty_on_mount);
+
+    /// index of reclaimable COW redundancy blocks, allocated and not frozen, built at mount and kept by bitset()
+    /// and set_attr(). every reclaim round ages all of them by one, so instead of counting each block down, a block
+    /// is filed under the round its cow_refresh_count runs out, cow_epoch + cow_refresh_count when it is indexed
+    uint64_t cow_epoch = 0;                                         /// reclaim rounds since mount
+    std::unordered_map < uint64_t, uint64_t > cow_expiry;           /// block -> expiry round
+    std::map < uint64_t, std::vector < uint64_t > > cow_buckets;    /// expiry round -> blocks, may hold stale entries
+    uint64_t cow_bucket_entries = 0;                                /// entries in cow_buckets, stale ones included
+
+    /// refile a block in the COW index after its allocation state or attributes changed
+    void cow_index_update(uint64_t index);
+
 public:
-    cfs_head_t get_header();    /// read header from disk
+    cfs_head_t get_header();    /// read header from disk, with the allocation counters held in memory
 
 private:
     /*!
@@ -50,16 +85,88 @@ private:
 public:
     class no_space_available final : std::exception { };    /// Filesystem is running out of space
     explicit blk_manager(block_io_t & block_io);
-    uint64_t allocate_block(); /// allocate block
+    ~blk_manager();
+    uint64_t allocate_block(uint64_t hint = UINT64_MAX); /// allocate block, see allocate_extent()
+
+    /*!
+     * @brief allocate a run of continuous blocks, first fit from last allocation
+     * @param min Shortest run accepted
+     * @param max Longest run wanted
+     * @param hint Block the run should be close to. search starts where the last allocation hinted into the same
+     *  allocation group stopped, or at the hint itself. UINT64_MAX searches from the last allocation of all
+     * @return First block and length of the run, length is within [min, max]
+     */
+    std::pair < uint64_t, uint64_t > allocate_extent(uint64_t min, uint64_t max, uint64_t hint = UINT64_MAX);
     cfs_blk_attr_t get_attr(uint64_t index); /// get block attributes
     void set_attr(uint64_t index, cfs_blk_attr_t val); /// set block attributes
+
+    /// age every COW redundancy block by one round and free the ones with the least rounds left
+    /// @return Blocks freed, 0 if there is no COW redundancy block to reclaim
+    uint64_t reclaim_cow_blocks();
+
+    /*!
+     * @brief visit attributes of blocks [first, first + count) in memory, attributes changed by the visitor are kept
+     * @param visitor Called as visitor(index, cfs_blk_attr_t & attr)
+     */
+    template < typename Visitor >
+    void for_each_attr(const uint64_t first, const uint64_t count, Visitor && visitor)
+    {
+        block_attr->for_each(first, count, [&](const uint64_t index, uint16_t & value) {
+            const uint16_t before = value;
+            visitor(index, *reinterpret_cast<cfs_blk_attr_t *>(&value));
+            if (value != before) {
+                if (bitget(index)) {
+                    count_usage(before, -1);
+                    count_usage(value, 1);
+                }
+                cow_index_update(index);
+            }
+        });
+    }
     bool block_allocated(const uint64_t index) { return bitget(index); }
-    uint64_t free_blocks() { const auto hd = get_header(); return blk_count - hd.runtime_info.allocated_blocks; } /// get how many blocks are free from header into
+    /// get how many blocks are free, reserved blocks not counted
+    [[nodiscard]] uint64_t free_blocks() const { return block_bitmap->free_count() - reserved_blocks; }
+    [[nodiscard]] uint64_t reserved() const { return reserved_blocks; } /// blocks reserved and not yet allocated
+
+    /// set aside `count` free blocks without allocating them, allocations not backed by a reservation
+    /// can no longer take them. throws no_space_available if fewer blocks are free
+    void reserve(uint64_t count);
+
+    /// give back `count` reserved blocks, either unused, or about to be allocated against the reservation
+    void release_reserved(uint64_t count);
+
+    /// reservations made by their owners are only valid if recorded under this generation
+    [[nodiscard]] uint64_t reservation_generation() const { return reservation_generation_; }
+
+    /// give back every reserved block and void every reservation recorded so far, by starting a new generation
+    void drop_reservations();
+
+    [[nodiscard]] uint64_t allocated_blocks() const { return blk_count - block_bitmap->free_count(); }
+    [[nodiscard]] uint64_t allocated_cow_blocks() const { return cow_blocks; }      /// COW redundancy blocks
+    [[nodiscard]] uint64_t allocated_frozen_blocks() const { return frozen_blocks; } /// blocks frozen by snapshots
 
     /// deallocate a block
     /// @param block Target block
     void free_block(uint64_t block);
 
+    /// whole volume scans over the resident bitmap and attribute table, 16 entries at a time where AVX2 is available.
+    /// a data block is an allocated block that is neither frozen nor COW redundancy
+    void freeze_data_blocks();                            /// freeze every data block but block 0, and count one more link
+    void free_data_blocks();                              /// free every data block but block 0
+
+#ifdef __UNIT_TEST_SUIT_ACTIVE__
+    bool scalar_scans = false;  /// freeze_data_blocks() and free_data_blocks() skip their SIMD kernels
+#endif
+
+    /// write resident allocation state back to its blocks in cache and the header, done before every sync
+    void flush();
+
+    /// resident bitmap and attribute table hold no change made for an inode other than `owner`,
+    /// flushing them then persists allocation changes of `owner` only
+    [[nodiscard]] bool changes_only_from(const uint64_t owner) const {
+        return block_bitmap->changes_only_from(owner) && block_attr->changes_only_from(owner);
+    }
+
     [[nodiscard]] block_io_t::safe_block_t safe_get_block(const uint64_t block)
     {
         if (get_attr(block).frozen) {
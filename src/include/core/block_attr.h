@@ -1,6 +1,8 @@
 #ifndef BLOCK_ATTR_H
 #define BLOCK_ATTR_H
 
+#include <vector>
+#include <algorithm>
 #include "core/block_io.h"
 
 #define INDEX_TYPE          static_cast<uint16_t>(1)
@@ -24,25 +26,78 @@ inline uint16_t cfs_blk_attr_t_to_uint16(cfs_blk_attr_t attr) {
     return ret;
 }
 
+/// block attribute table, kept resident as one entry per data block. changes reach the on-disk table on flush() only
 class block_attr_t {
     block_io_t & io;
     const uint64_t block_size;
     const uint64_t attr_region_start;
     const uint64_t attr_region_end;
     const uint64_t entries;
+    std::vector < uint16_t > table;         /// whole table, padded to full blocks
+    std::vector < bool > block_dirty;       /// table block changed since last flush, by block offset in table
+    std::vector < uint64_t > dirty_blocks;  /// offsets of changed table blocks
+    uint64_t changes_owner = NO_DIRTY_OWNER; /// inode every change since last flush was made for, see block_io_t::set_dirty_owner()
     void linear_write(const void * data, uint64_t size, uint64_t offset);
     void linear_read(void * data, uint64_t size, uint64_t offset);
 
+    void check_range(uint64_t first, uint64_t count) const;
+
 public:
-    explicit block_attr_t(block_io_t & io, const uint64_t block_size,
-        const uint64_t attr_region_start, const uint64_t attr_region_end, const uint64_t entries)
-        : io(io),
-        block_size(block_size),
-        attr_region_start(attr_region_start),
-        attr_region_end(attr_region_end),
-        entries(entries) {}
-    uint16_t get(uint64_t index);
+    explicit block_attr_t(block_io_t & io, uint64_t block_size,
+        uint64_t attr_region_start, uint64_t attr_region_end, uint64_t entries);
+    ~block_attr_t();                        /// flush
+    block_attr_t(const block_attr_t &) = delete;
+    block_attr_t & operator=(const block_attr_t &) = delete;
+
+    [[nodiscard]] uint16_t get(uint64_t index) const;
     void set(uint64_t index, uint16_t value);
+
+    /// copy entries [first, first + count) out to `values`
+    void get_range(uint64_t first, uint64_t count, uint16_t * values) const;
+
+    /// overwrite entries [first, first + count) with `values`
+    void set_range(uint64_t first, uint64_t count, const uint16_t * values);
+
+    /*!
+     * @brief visit entries [first, first + count) in order, entries changed by the visitor are written back
+     * @param visitor Called as visitor(index, uint16_t & value)
+     */
+    template < typename Visitor >
+    void for_each(const uint64_t first, const uint64_t count, Visitor && visitor)
+    {
+        check_range(first, count);
+        const uint64_t entries_per_block = block_size / sizeof(uint16_t);
+        for (uint64_t index = first; index < first + count;)
+        {
+            // one table block at a time, so a changed block is marked dirty once
+            const uint64_t block_end = std::min(first + count, (index / entries_per_block + 1) * entries_per_block);
+            bool changed = false;
+            for (; index < block_end; index++)
+            {
+                const uint16_t before = table[index];
+                visitor(index, table[index]);
+                changed |= before != table[index];
+            }
+
+            if (changed) {
+                mark_dirty(block_end - 1, 1);
+            }
+        }
+    }
+
+    /// resident entries, padded to full table blocks. entries changed through it must be marked with mark_dirty()
+    [[nodiscard]] uint16_t * raw_entries() { return table.data(); }
+    [[nodiscard]] const uint16_t * raw_entries() const { return table.data(); }
+
+    /// mark table blocks holding entries [first, first + count) as changed
+    void mark_dirty(uint64_t first, uint64_t count);
+
+    void flush();                           /// write changed entries back to table blocks in cache
+
+    /// no change since last flush, or every change was made for inode `owner`
+    [[nodiscard]] bool changes_only_from(const uint64_t owner) const {
+        return dirty_blocks.empty() || changes_owner == owner;
+    }
 };
 
 #endif //BLOCK_ATTR_H
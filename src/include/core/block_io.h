@@ -1,14 +1,23 @@
 #ifndef BLOCK_IO_H
 #define BLOCK_IO_H
 
-#include <map>
 #include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "crc64sum.h"
 #include "core/basic_io.h"
+#include "core/buffer_pool.h"
+#include "core/cache_policy.h"
+#include "core/hash_table.h"
 #include "core/cfs.h"
 
 class read_only_filesystem final : std::exception {};
 
+/// dirty block was changed outside any inode, or by more than one inode
+#define NO_DIRTY_OWNER (UINT64_MAX)
+
 /*!
  * @brief block_io_t is an abstraction layer operating on block instead of 512 byte sectors, and offer a in-memory cache
  */
@@ -16,42 +25,39 @@ class block_io_t {
     /// public data block pointer, this element points to a specific block, and write to disk(sync) on deleting.
     class block_data_t;
 
-    /// block_data_t construction helper, to conseal details within the class member
-    class block_data_ptr_t {
-        block_data_t * ptr; /// block pointer
-    public:
-        explicit block_data_ptr_t(const uint64_t blk_sz, const uint64_t block_sector_start_,
-            const uint64_t block_sector_end_, basic_io_t & io_)
-            { ptr = new block_data_t(blk_sz, block_sector_start_, block_sector_end_, io_); }
-        ~block_data_ptr_t() { delete ptr; }
-        block_data_t * operator->() const { return ptr; }
-        block_data_t & operator*() const { return *ptr; }
-    };
-
 private:
-    class block_data_t
+    class block_data_t : public cache_node_t
     {
-        std::vector<uint8_t> data_;         /// in memory cache data
+        buffer_pool_t & pool;               /// pool data_ is borrowed from
+        const bool mapped;                  /// data_ is a view into disk mapping, not a copy
+        uint8_t * data_;                    /// in memory cache data, aligned for direct IO
         const uint64_t block_sector_start;  /// on-disk sector start [start, end)
         const uint64_t block_sector_end;    /// on-disk sector end [start, end)
         bool read_only{false};              /// disable alteration to this block
-        bool out_of_sync = false;           /// if data changed in memory but not reflected onto file
+        /// if data changed in memory but not reflected onto file. cleared before a write-back reads data_,
+        /// so an update racing with background write-back leaves the block dirty again
+        std::atomic < bool > out_of_sync = false;
+        std::atomic < uint64_t > dirty_since = 0; /// when the block turned dirty, milliseconds of steady clock
+        uint64_t dirty_owner = NO_DIRTY_OWNER; /// inode which dirtied the block, NO_DIRTY_OWNER if unknown or several
         bool in_use{false};                 /// block is in use, set after being thrown out by at, needs manual cleaning. cache won't delete in-use blocks
+        std::mutex data_mutex;              /// held by update() while data_ changes, and by write-back while data_ is read
         basic_io_t & io;                    /// basic IO
-        explicit block_data_t(const uint64_t block_size, const uint64_t block_sector_start_,
-            const uint64_t block_sector_end_, basic_io_t & io_)
-            : block_sector_start(block_sector_start_), block_sector_end(block_sector_end_), io(io_)
-        { data_.resize(block_size); }
-        ~block_data_t() { sync(); }         /// sync on destruction
+        block_io_t & mother;                /// owning cache, keeps dirty accounting
+        explicit block_data_t(buffer_pool_t & pool_, uint8_t * mapped_view_, const uint64_t block_sector_start_,
+            const uint64_t block_sector_end_, basic_io_t & io_, block_io_t & mother_)
+            : pool(pool_), mapped(mapped_view_ != nullptr), data_(mapped ? mapped_view_ : pool_.acquire()),
+              block_sector_start(block_sector_start_), block_sector_end(block_sector_end_), io(io_),
+              mother(mother_) { }
+        ~block_data_t() { sync(); if (out_of_sync) mother.dirty_blocks--; if (!mapped) pool.release(data_); } /// sync on destruction
 
     public:
-        [[nodiscard]] size_t size() const { return data_.size(); }  /// data size, should always be block size
+        [[nodiscard]] size_t size() const { return pool.size(); }  /// data size, should always be block size
         void get(uint8_t * buf, size_t sz, uint64_t in_blk_off);    /// read data
         void update(const uint8_t * new_data, size_t new_size, uint64_t in_block_offset);   /// update cache
         void sync();                        /// write to disk
         [[nodiscard]] bool is_out_of_sync() const { return out_of_sync; } /// check if update() is called
         void not_in_use() { in_use = false; }
-        uint64_t crc64() const { CRC64 crc64; crc64.update(data_.data(), data_.size()); return crc64.get_checksum(); }
+        uint64_t crc64() const { CRC64 crc64; crc64.update(data_, size()); return crc64.get_checksum(); }
         friend class block_io_t;
     };
 
@@ -66,10 +72,9 @@ public:
     public:
         block_data_t * operator->()
         {
-            {
-                if (mother.block_cache.contains(block_id)) {
-                    return block;
-                }
+            // one probe, and a block evicted then cached again at another address is caught too
+            if (mother.block_cache.find(block_id) == block) {
+                return block;
             }
 
             // auto renew
@@ -85,14 +90,7 @@ public:
 
         ~safe_block_t()
         {
-            bool not_in_use = false;
-            {
-                if (mother.block_cache.contains(block_id)) {
-                    not_in_use = true;
-                }
-            }
-
-            if (not_in_use) {
+            if (mother.block_cache.find(block_id) == block) {
                 block->not_in_use();
             }
         }
@@ -102,18 +100,56 @@ private:
     basic_io_t & io;                        /// basic IO
     cfs_head_t cfs_head{};                  /// in memory head
     bool filesystem_dirty_on_mount_;    /// if filesystem is dirty on mount
-    std::map < uint64_t /* block id */, std::unique_ptr < block_data_ptr_t > > block_cache; /// cache
-    std::map < uint64_t /* block id */, uint64_t /* access time */ > access_frequencies;
+    std::unique_ptr < buffer_pool_t > buffer_pool; /// block buffers, preallocated for the whole cache
+    std::unique_ptr < buffer_pool_t > block_slab;  /// block_data_t objects, preallocated for the whole cache
+    open_hash_table_t < block_data_t > block_cache; /// cache, by block id. cached blocks are owned here
+    std::unique_ptr < cache_policy_t > cache_policy; /// decides which cached blocks are evicted
     uint64_t max_cached_block_number;   /// max cached block allowed in memory
     bool read_only_fs;
 
+    /// guards the cache and block states against background write-back. filesystem threads are serialized above
+    /// block_io_t, blocks already handed out are changed without it, under their own data_mutex
+    std::mutex cache_mutex;
+    std::atomic < uint64_t > dirty_blocks = 0; /// out-of-sync blocks in cache
+    uint64_t dirty_owner = NO_DIRTY_OWNER;  /// inode blocks dirtied now are recorded for, see set_dirty_owner()
+    std::condition_variable writeback_condition; /// wakes write-back early, dirty limit reached or stop requested
+    std::condition_variable throttle_condition;  /// wakes writers throttled at dirty limit
+    bool writeback_stop = false;
+    bool writeback_kicked = false;          /// a writer hit dirty limit, write back without waiting for the interval
+    std::thread writeback_thread;
+
     void filesystem_verification();         /// filesystem basic health check
     void unblocked_sync_header();           /// sync head to disk
 
+    /// write back out-of-sync blocks, blocks adjacent on disk are merged into one vectored write
+    void unblocked_flush(std::vector < block_data_t * > & blocks);
+    void unblocked_flush_all();             /// write back every out-of-sync block in cache
+
+    static bool evictable(const cache_node_t * node);   /// block can be evicted now
+    void unblocked_evict();                 /// write back and drop a small batch of blocks chosen by cache policy
+    void unblocked_clear_cache();           /// drop every cached block, without writing back
+    block_data_t * make_block(uint64_t index); /// construct a block in slab, neither read nor cached yet
+    void destroy_block(block_data_t * block); /// destruct a cached block, give its memory back to slab
+
+    /// write back one batch of dirty blocks, expired ones, and the oldest ones while above the background ratio.
+    /// @return false if nothing was left to write
+    bool unblocked_writeback_round();
+    void writeback_main();                  /// background write-back thread
+
 public:
-    explicit block_io_t(basic_io_t & io, bool read_only_fs = false);
+    /// @param options mount options, block_io_t takes cache policy and hugepage settings from it
+    explicit block_io_t(basic_io_t & io, bool read_only_fs = false, const mount_options_t & options = {});
     [[nodiscard]] bool filesystem_dirty_on_mount() const { return filesystem_dirty_on_mount_; } /// is filesystem dirty?
-    void sync();                            /// sync
+    [[nodiscard]] bool read_only() const { return read_only_fs; } /// is filesystem mounted read-only?
+    void sync();                            /// write back every dirty block and header, cached blocks stay cached
+
+    /// blocks dirtied from now on are recorded as dirtied by inode `owner`, NO_DIRTY_OWNER stops recording
+    void set_dirty_owner(const uint64_t owner) { dirty_owner = owner; }
+    [[nodiscard]] uint64_t get_dirty_owner() const { return dirty_owner; } /// see set_dirty_owner()
+
+    /// write back blocks dirtied by inode `owner`, blocks without a single known owner, and the journal
+    void sync_owner(uint64_t owner);
+    void drop_caches();                     /// sync, then drop every cached block
     ~block_io_t();
 
 private:
@@ -124,27 +160,37 @@ private:
      * @param index Block index (while disk)
      * @return block_data_t, block pointer
      */
-    block_data_t & at(uint64_t index);
+    block_data_t & at(uint64_t index, bool get_as_read_only = false);
 
 public:
+    /// read blocks not yet cached into cache in one batch, blocks continuous on disk are read by one request.
+    /// a hint only, capped to a quarter of cache, and a no-op when disk is mapped
+    void prefetch(const std::vector < uint64_t > & indices);
+
+    /// max cached block number
+    [[nodiscard]] uint64_t cache_capacity() const { return max_cached_block_number; }
+
 
     safe_block_t safe_at(const uint64_t index, bool get_as_read_only = false)
     {
-        auto & blk = at(index);
-        if (get_as_read_only) {
-            blk.read_only = true;
-        }
-        return safe_block_t(blk, *this, index);
+        return safe_block_t(at(index, get_as_read_only), *this, index);
     }
 
     /*!
-     * update runtime info in header, static info will be ignored
+     * update runtime info and usage info in header, static info will be ignored
      * @param head New header
      */
     void update_runtime_info(cfs_head_t head);
 
 #ifdef __UNIT_TEST_SUIT_ACTIVE__
     [[nodiscard]] uint64_t get_block_size() const { return cfs_head.static_info.block_size; }
+    void set_max_cached_block_number(const uint64_t number) {
+        max_cached_block_number = number;
+        cache_policy->set_capacity(number);
+    }
+    [[nodiscard]] uint64_t get_cached_block_number() const { return block_cache.size(); }
+    [[nodiscard]] bool is_cached(const uint64_t index) const { return block_cache.contains(index); }
+    [[nodiscard]] uint64_t get_dirty_block_number() const { return dirty_blocks; }
 #endif
 };
 
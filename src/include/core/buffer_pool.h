@@ -0,0 +1,56 @@
+/* buffer_pool.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstdint>
+#include <vector>
+
+/// preallocated pool (slab) of equally sized, aligned buffers. acquire/release are free list operations only,
+/// so cache churn does no heap allocation while the pool lasts
+class buffer_pool_t
+{
+    uint8_t * region = nullptr;             /// all pooled buffers, one continuous anonymous mapping
+    uint64_t region_size = 0;               /// mapping size
+    const uint64_t buffer_size;             /// usable size of one buffer
+    const uint64_t buffer_stride;           /// distance between two pooled buffers, a multiple of alignment
+    const uint64_t buffer_count;            /// pooled buffer count
+    const uint64_t alignment;               /// buffer alignment
+    std::vector < uint8_t * > free_buffers; /// pooled buffers not handed out
+
+public:
+    /// preallocate `buffer_count` buffers of `buffer_size` bytes, each aligned to `alignment` (at most page size).
+    /// `huge_pages` backs the pool with hugetlb pages if reserved, transparent hugepages otherwise
+    buffer_pool_t(uint64_t buffer_size, uint64_t buffer_count, uint64_t alignment, bool huge_pages = false);
+    ~buffer_pool_t();
+    buffer_pool_t(const buffer_pool_t &) = delete;
+    buffer_pool_t & operator=(const buffer_pool_t &) = delete;
+
+    /// get a buffer, falls back to a standalone aligned allocation when the pool is depleted
+    uint8_t * acquire();
+
+    /// return a buffer obtained by acquire()
+    void release(uint8_t * buffer);
+
+    [[nodiscard]] uint64_t size() const { return buffer_size; }
+};
+
+#endif //BUFFER_POOL_H
@@ -0,0 +1,81 @@
+/* cache_policy.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef CACHE_POLICY_H
+#define CACHE_POLICY_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// intrusive per-entry policy state, embedded in every cached object
+struct cache_node_t
+{
+    cache_node_t * prev = nullptr;          /// more recently used neighbour
+    cache_node_t * next = nullptr;          /// less recently used neighbour
+    uint64_t key = 0;                       /// cache key, block id
+    uint8_t list = 0;                       /// policy specific, which list this node is in
+};
+
+/// intrusive doubly linked list of cache nodes, head is most recently used
+class cache_node_list_t
+{
+    cache_node_t * head_ = nullptr;
+    cache_node_t * tail_ = nullptr;
+    uint64_t size_ = 0;
+
+public:
+    void push_front(cache_node_t * node);
+    void unlink(cache_node_t * node);
+    void clear() { head_ = tail_ = nullptr; size_ = 0; }
+    [[nodiscard]] cache_node_t * head() const { return head_; }
+    [[nodiscard]] cache_node_t * tail() const { return tail_; }
+    [[nodiscard]] uint64_t size() const { return size_; }
+};
+
+/// replacement policy of a cache holding at most `capacity` entries. policy only orders entries, owner stores them
+class cache_policy_t
+{
+protected:
+    uint64_t capacity;
+
+public:
+    /// predicate telling if an entry can be evicted right now
+    using evictable_t = bool (*)(const cache_node_t *);
+
+    explicit cache_policy_t(const uint64_t capacity) : capacity(capacity) { }
+    virtual ~cache_policy_t() = default;
+
+    virtual void insert(cache_node_t * node) = 0;   /// entry newly cached, node->key is set
+    virtual void access(cache_node_t * node) = 0;   /// cache hit
+    virtual void erase(cache_node_t * node) = 0;    /// entry dropped from cache
+    virtual void clear() = 0;                       /// every entry dropped, history is kept
+
+    /// pick at most `count` evictable entries to drop, best candidates first. entries stay cached until erase()
+    virtual void select_victims(std::vector < cache_node_t * > & victims, uint64_t count, evictable_t evictable) = 0;
+
+    virtual void set_capacity(const uint64_t new_capacity) { capacity = new_capacity; }
+};
+
+/// create a replacement policy by name, one of "lru", "2q", "arc". throws runtime_error on unknown names
+std::unique_ptr < cache_policy_t > make_cache_policy(const std::string & name, uint64_t capacity);
+
+#endif //CACHE_POLICY_H
@@ -23,6 +23,7 @@
 
 #include <cstdint>
 #include <chrono>
+#include <string>
 
 int mkfs_main(int argc, char **argv);
 int mount_main(int argc, char **argv);
@@ -69,14 +70,23 @@ struct cfs_head_t
     uint64_t info_table_checksum_;
 
     struct {
-        uint64_t _1;
-        uint64_t _2;
-        uint64_t _3;
-        uint64_t _4;
-        uint64_t _5;
-        uint64_t _6;
-        uint64_t _7;
-        uint64_t _8;
+        uint64_t cow_blocks;            // allocated blocks that are copy-on-write redundancy
+        uint64_t frozen_blocks;         // allocated blocks frozen by snapshots
+        uint64_t checksum;              // hashcrc64 of the two above, counters are only valid if it matches
+    } usage_info; // usage counters, written at sync points
+
+    struct {
+        uint64_t checksum;              // checksum of the allocation bitmap as written at the last sync point
+        uint64_t checksum_guard;        // hashcrc64 of checksum, checksum is only valid if it matches
+    } bitmap_info; // the bitmap mirror is verified and repaired against this on mount
+
+    struct {
+        uint64_t blocks;                // free blocks reserved for holes of files, not yet allocated
+        uint64_t generation;            // inode blocks record their reservation under this, others are void
+        uint64_t checksum;              // hashcrc64 of the two above, reservations are only valid if it matches
+    } reservation_info; // written at sync points, reservations are dropped on a mount after unclean unmount
+
+    struct {
         uint64_t _9;
         uint64_t _10;
         uint64_t _11;
@@ -102,6 +112,21 @@ struct cfs_head_t
 };
 static_assert(sizeof(cfs_head_t) == SECTOR_SIZE, "Faulty head size");
 
+/// runtime options given at mount time, not persisted on disk
+struct mount_options_t
+{
+    bool io_uring = false;      /// submit block IO through io_uring instead of synchronous system calls
+    bool direct_io = false;     /// open disk with O_DIRECT, block cache is then the only cache
+    /// map the disk into memory, cached blocks become views into the mapping. the kernel writes dirty pages back
+    /// whenever it likes, so there is no write ordering, and half done metadata updates can reach disk before a crash.
+    /// IO errors arrive as SIGBUS and crash the filesystem instead of failing the operation
+    bool mmap = false;
+    bool discard = false;       /// discard freed blocks on backing storage (punch hole, or BLKDISCARD)
+    std::string cache_policy = "lru"; /// block cache replacement policy: lru, 2q or arc
+    bool huge_pages = false;    /// back block cache memory with hugepages
+    uint64_t reserve = 0;       /// percent of blocks kept free by reclaiming COW blocks in the background, 0 disables
+};
+
 inline uint64_t ceil_div(const uint64_t len, const uint64_t align) {
     return (len / align) + (len % align == 0 ? 0 : 1);
 }
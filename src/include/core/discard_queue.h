@@ -0,0 +1,61 @@
+/* discard_queue.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef DISCARD_QUEUE_H
+#define DISCARD_QUEUE_H
+
+#include <set>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "core/basic_io.h"
+
+/*!
+ * @brief discard_queue_t collects freed data field blocks, coalesces them into extents and discards them in the
+ * background. A freed block is only discarded after the next sync point, when the free is reflected on disk.
+ */
+class discard_queue_t
+{
+    basic_io_t & io;
+    const uint64_t data_field_sector_start; /// sector of data field block 0
+    const uint64_t block_over_sector;       /// sectors per block
+
+    std::mutex mutex;                       /// held while discarding, so a block cannot be reallocated mid-discard
+    std::condition_variable condition;
+    std::set < uint64_t > freed;            /// freed since last sync point
+    std::set < uint64_t > ready;            /// freed before last sync point, waiting for the worker
+    bool stop = false;
+    bool unsupported = false;               /// backing storage refused a discard, stop trying
+    std::thread worker;
+
+    void worker_main();
+
+public:
+    discard_queue_t(basic_io_t & io, uint64_t data_field_sector_start, uint64_t block_over_sector);
+    ~discard_queue_t();                     /// discard whatever is ready, then stop
+    discard_queue_t(const discard_queue_t &) = delete;
+    discard_queue_t & operator=(const discard_queue_t &) = delete;
+
+    void push(uint64_t data_field_block_id);    /// block is freed
+    void cancel(uint64_t data_field_block_id);  /// block is allocated again, never discard it
+    void commit();                          /// sync point, hand every freed block to the worker
+};
+
+#endif //DISCARD_QUEUE_H
@@ -0,0 +1,139 @@
+/* hash_table.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include <cstdint>
+#include <vector>
+#include <bit>
+
+/*!
+ * @brief open addressing (linear probing) hash table from uint64_t keys to non-owning pointers.
+ * deletion shifts following entries back, so there are no tombstones and lookups stay short
+ */
+template < typename Type >
+class open_hash_table_t
+{
+    static constexpr uint64_t empty_key = UINT64_MAX;
+    struct slot_t {
+        uint64_t key = empty_key;
+        Type * value = nullptr;
+    };
+
+    std::vector < slot_t > slots;
+    uint64_t mask = 0;
+    int shift = 0;
+    uint64_t size_ = 0;
+
+    [[nodiscard]] uint64_t home(const uint64_t key) const {
+        return (key * 0x9E3779B97F4A7C15ULL) >> shift; // fibonacci hashing, spreads sequential block ids
+    }
+
+    void rehash(const uint64_t capacity)
+    {
+        std::vector < slot_t > old(capacity);
+        old.swap(slots);
+        mask = capacity - 1;
+        shift = 64 - std::countr_zero(capacity);
+        size_ = 0;
+        for (const auto & slot : old) {
+            if (slot.key != empty_key) {
+                insert(slot.key, slot.value);
+            }
+        }
+    }
+
+public:
+    open_hash_table_t() { rehash(64); }
+
+    /// pointer stored under `key`, nullptr if absent
+    [[nodiscard]] Type * find(const uint64_t key) const
+    {
+        for (uint64_t i = home(key); ; i = (i + 1) & mask)
+        {
+            if (slots[i].key == key) return slots[i].value;
+            if (slots[i].key == empty_key) return nullptr;
+        }
+    }
+
+    [[nodiscard]] bool contains(const uint64_t key) const { return find(key) != nullptr; }
+
+    /// insert or replace
+    void insert(const uint64_t key, Type * value)
+    {
+        if ((size_ + 1) * 4 > slots.size() * 3) { // keep load under 3/4
+            rehash(slots.size() * 2);
+        }
+
+        uint64_t i = home(key);
+        for (; slots[i].key != empty_key; i = (i + 1) & mask) {
+            if (slots[i].key == key) {
+                slots[i].value = value;
+                return;
+            }
+        }
+
+        slots[i] = { key, value };
+        size_++;
+    }
+
+    /// remove `key`, returns the pointer stored under it or nullptr
+    Type * erase(const uint64_t key)
+    {
+        uint64_t i = home(key);
+        for (; slots[i].key != key; i = (i + 1) & mask) {
+            if (slots[i].key == empty_key) return nullptr;
+        }
+
+        Type * ret = slots[i].value;
+        // backward shift deletion: pull later entries of the probe chain into the hole
+        for (uint64_t j = (i + 1) & mask; slots[j].key != empty_key; j = (j + 1) & mask)
+        {
+            const uint64_t h = home(slots[j].key);
+            // entry at j may move to i only if its home is not within (i, j]
+            if (((j - h) & mask) >= ((j - i) & mask)) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+
+        slots[i] = {};
+        size_--;
+        return ret;
+    }
+
+    void clear() { slots.assign(slots.size(), slot_t{}); size_ = 0; }
+
+    /// call `func(key, value)` on every entry
+    template < typename Func >
+    void for_each(Func func) const
+    {
+        for (const auto & slot : slots) {
+            if (slot.key != empty_key) {
+                func(slot.key, slot.value);
+            }
+        }
+    }
+
+    [[nodiscard]] uint64_t size() const { return size_; }
+};
+
+#endif //HASH_TABLE_H
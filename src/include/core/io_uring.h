@@ -0,0 +1,75 @@
+/* io_uring.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <linux/io_uring.h>
+
+/// minimal io_uring ring on raw system calls, one submission queue and one completion queue
+class io_uring_t
+{
+    int ring_fd = -1;                       /// ring file descriptor
+
+    void * sq_ring = nullptr;               /// submission queue ring mapping
+    size_t sq_ring_size = 0;
+    unsigned * sq_head = nullptr;
+    unsigned * sq_tail = nullptr;
+    unsigned * sq_ring_mask = nullptr;
+    unsigned * sq_array = nullptr;
+    io_uring_sqe * sqes = nullptr;          /// submission queue entries
+    size_t sqes_size = 0;
+    unsigned sqe_tail = 0;                  /// local tail, published on submit()
+    unsigned sqe_submitted = 0;             /// local tail already handed over to kernel
+
+    void * cq_ring = nullptr;               /// completion queue ring mapping, may alias sq_ring
+    size_t cq_ring_size = 0;
+    unsigned * cq_head = nullptr;
+    unsigned * cq_tail = nullptr;
+    unsigned * cq_ring_mask = nullptr;
+    io_uring_cqe * cqes = nullptr;
+
+    unsigned entries_ = 0;                  /// submission queue depth
+
+public:
+    /// set up a ring with `entries` submission slots, throws runtime_error if io_uring is unavailable
+    explicit io_uring_t(unsigned entries);
+    ~io_uring_t();
+    io_uring_t(const io_uring_t &) = delete;
+    io_uring_t & operator=(const io_uring_t &) = delete;
+
+    /// get a zeroed submission entry, nullptr if submission queue is full
+    io_uring_sqe * get_sqe();
+
+    /// hand all prepared entries to kernel, optionally wait for `wait_nr` completions
+    void submit(unsigned wait_nr = 0);
+
+    /// reap one completion if available
+    bool peek(io_uring_cqe & cqe);
+
+    /// reap one completion, block until one is available
+    void wait(io_uring_cqe & cqe);
+
+    [[nodiscard]] unsigned entries() const { return entries_; }
+};
+
+#endif //IO_URING_H
@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include <sys/stat.h>
+#include "core/cfs.h"
 
 int do_getattr (const char *path, struct stat *stbuf);
 int do_readdir (const char *path, std::vector < std::string > & entries);
@@ -27,13 +28,14 @@ int do_truncate (const char * path, off_t size);
 int do_symlink  (const char * path, const char * target);
 int do_snapshot(const char * name);
 int do_rollback(const char * name);
+int do_drop_caches();
 int do_rename (const char * path, const char * name);
 int do_fallocate(const char * path, int mode, off_t offset, off_t length);
 int do_fgetattr (const char * path, struct stat * statbuf);
 int do_ftruncate (const char * path, off_t length);
 int do_readlink (const char * path, char * buffer, size_t size);
 void do_destroy ();
-void do_init(const std::string & location);
+void do_init(const std::string & location, const mount_options_t & options = {});
 int do_mknod (const char * path, mode_t mode, dev_t device);
 struct statvfs do_fstat();
 
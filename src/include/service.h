@@ -22,6 +22,7 @@
 #define SERVICE_H
 
 #include <memory>
+#include <deque>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include "service.h"
@@ -81,11 +82,59 @@ namespace fs_error {
 class filesystem
 {
     basic_io_t basic_io;
+    std::unique_ptr < discard_queue_t > discard_queue;
     std::unique_ptr < block_io_t > block_io;
     std::unique_ptr < blk_manager > block_manager;
     std::map < uint64_t, struct stat > stat_temp_list;
 
+    /// sequential read detection of one inode
+    struct readahead_state_t {
+        uint64_t next_block = 0;            /// block a sequential read continues at
+        uint64_t window = 0;                /// blocks read ahead of the reader, 0 while access is random
+        uint64_t prefetched_until = 0;      /// blocks before this one are already read ahead
+    };
+    std::map < uint64_t, readahead_state_t > readahead_states; /// by inode id
+
+    uint64_t reserve_blocks = 0;            /// free blocks the background reclaimer keeps, see mount_options_t::reserve
+
     uint64_t unblocked_allocate_new_block();
+
+    /// blocks are allocated close to this one, UINT64_MAX for no preference. set for the span of an inode operation,
+    /// so an inode's blocks land near the inode, and a new inode near its parent directory
+    uint64_t allocation_hint = UINT64_MAX;
+
+    class allocation_hint_scope_t
+    {
+        filesystem & fs;
+        const uint64_t previous_hint;
+
+    public:
+        allocation_hint_scope_t(filesystem & fs, const uint64_t hint) : fs(fs), previous_hint(fs.allocation_hint) {
+            fs.allocation_hint = hint;
+        }
+        ~allocation_hint_scope_t() { fs.allocation_hint = previous_hint; }
+        allocation_hint_scope_t(const allocation_hint_scope_t &) = delete;
+        allocation_hint_scope_t & operator=(const allocation_hint_scope_t &) = delete;
+    };
+
+    std::deque < uint64_t > preallocated_blocks; /// handed out by unblocked_allocate_new_block() before anything else
+
+    /// allocate `count` blocks ahead in as few continuous extents as free space allows. blocks that cannot
+    /// be preallocated are allocated one by one on demand, where COW blocks can be reclaimed
+    void preallocate_blocks(uint64_t count);
+    void release_preallocated_blocks();     /// free preallocated blocks never handed out
+
+    /// blocks reserved by inode_t::fallocate() for inode_id, recorded in its inode block. covers every hole of the
+    /// inode, holes take from it as they are written. 0 for frozen inodes, whose live copy holds the reservation,
+    /// and for reservations recorded before they were last dropped, see blk_manager::drop_reservations()
+    uint64_t reservation_of(uint64_t inode_id);
+    void set_reservation(uint64_t inode_id, uint64_t count); /// record inode_id's reservation in its inode block
+
+    /// reserve `count` more blocks for inode_id, reclaiming COW blocks if short. throws filesystem_space_depleted
+    void reserve_for_inode(uint64_t inode_id, uint64_t count);
+    /// one block of inode_id's reservation is about to be allocated. false if it has none
+    bool take_reservation(uint64_t inode_id);
+    void cap_reservation(uint64_t inode_id, uint64_t max); /// give back inode_id's reserved blocks above `max`
     void unblocked_deallocate_block(uint64_t data_field_block_id);
     uint64_t unblocked_read_block(uint64_t data_field_block_id, void * buff, uint64_t size, uint64_t offset);
     uint64_t unblocked_write_block(uint64_t data_field_block_id, const void * buff, uint64_t size, uint64_t offset, bool cow_active);
@@ -107,6 +156,18 @@ class filesystem
         return unblocked_write_block(data_field_block_id, buff, size, offset, cow_active);
     }
 
+    /// read data field blocks into cache in one batch, null pointers (0) are skipped
+    void prefetch_blocks(const std::vector < uint64_t > & data_field_block_ids);
+
+    /*!
+     * @brief detect sequential reads of an inode and read ahead of them
+     * @param inode_id inode being read
+     * @param level3_blocks storage blocks of the inode
+     * @param first_block first storage block position the read touches
+     * @param last_block last storage block position the read touches
+     */
+    void readahead(uint64_t inode_id, const std::vector < uint64_t > & level3_blocks, uint64_t first_block, uint64_t last_block);
+
     cfs_blk_attr_t get_attr(uint64_t data_field_block_id);
     void set_attr(uint64_t data_field_block_id, cfs_blk_attr_t attr);
     void freeze_block();
@@ -187,16 +248,33 @@ public:
             struct stat attributes;
         };
 
+        /// blocks reserved for holes of the inode, stored right after inode_header_t. see filesystem::reservation_of()
+        struct inode_reservation_t {
+            uint64_t blocks;
+            uint64_t generation;    // blocks are void unless recorded under the reservation generation of the mount
+        };
+
     private:
+        /// level 1 pointers follow the header and the reservation in the inode block
+        static constexpr uint64_t pointers_offset = sizeof(inode_header_t) + sizeof(inode_reservation_t);
+
         inode_header_t unblocked_get_header();
         void unblocked_save_header(inode_header_t);
         std::vector < uint64_t > get_inode_block_pointers(); /// get pointers inside inode (level 1 pointers)
         void save_inode_block_pointers(const std::vector < uint64_t > & block_pointers); /// save pointers to inode (level 1 pointers)
         std::vector < uint64_t > get_pointer_by_block(uint64_t data_field_block_id);
         void save_pointer_to_block(uint64_t data_field_block_id, const std::vector < uint64_t > & block_pointers);
-        void unblocked_resize(uint64_t file_length);
+        /// @param sparse new storage blocks are left as holes (null pointers), only pointer blocks are allocated
+        void unblocked_resize(uint64_t file_length, bool sparse = false);
         void redirect_3rd_level_block(uint64_t old_data_field_block_id, uint64_t new_data_field_block_id);
 
+        /// save pointers to a pointer block, or to a copy of it if the block is frozen
+        /// @return true if redirected to a copy, `data_field_block_id` is the copy then, and its parent needs saving
+        bool save_pointer_to_block_or_copy(uint64_t & data_field_block_id, const std::vector<uint64_t> & block_pointers);
+        void drop_block_link(uint64_t data_field_block_id); /// drop one link of a block, deallocate it when it was the last one
+        std::vector < uint64_t > level3_pointers_by_position(); /// storage blocks by position in file, holes as null pointers
+        void set_level3_pointer(uint64_t position, uint64_t data_field_block_id); /// point storage block `position` to a block
+
     public:
         std::vector<uint64_t> linearized_level3_pointers();
         std::vector<uint64_t> linearized_level2_pointers();
@@ -206,6 +284,10 @@ public:
         [[nodiscard]] inode_header_t get_header();
         void save_header(const inode_header_t & header);
         void resize(uint64_t new_size);
+
+        /// make sure [offset, offset + length) can be written without running out of space. the file is extended
+        /// with holes, and blocks for every hole of the file are reserved, not written. see reservation_of()
+        void fallocate(uint64_t offset, uint64_t length);
         void unlink_self();
     };
 
@@ -258,8 +340,17 @@ public:
     }
 
     void sync();
+    void drop_caches();                     /// sync, and drop every cached block
+    void fsync(uint64_t inode_id);          /// write back blocks inode_id depends on, and the journal
+    void set_dirty_owner(const uint64_t inode_id) { block_io->set_dirty_owner(inode_id); } /// see block_io_t::set_dirty_owner()
     struct statvfs fstat();
-    explicit filesystem(const char * location);
+
+    /// run one COW reclaim round if free blocks are below the reserve
+    /// @return true if blocks were freed, and another round may be needed
+    bool reclaim_reserve_round();
+    [[nodiscard]] bool reserve_enabled() const { return reserve_blocks != 0; }
+
+    explicit filesystem(const char * location, const mount_options_t & options = {});
     ~filesystem();
 };
 
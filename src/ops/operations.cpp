@@ -4,6 +4,8 @@
 #include <sstream>
 #include <functional>
 #include <atomic>
+#include <thread>
+#include <condition_variable>
 #include "operations.h"
 #include "service.h"
 #include "helper/log.h"
@@ -11,10 +13,38 @@
 
 std::unique_ptr < filesystem > filesystem_instance;
 std::mutex operations_mutex;
-std::atomic_bool content_changed_out_of_sync_to_fstat = true;
 std::atomic_bool content_changed_out_of_sync_to_get_inode = true;
 std::map < std::string /* path */, uint64_t /* inode */ > path_to_inode_fast_map;
 
+/// background reclaimer, keeps the free block reserve topped up so writes on a full volume
+/// find free blocks instead of reclaiming COW blocks inline. checks the reserve this often
+#define RECLAIM_INTERVAL std::chrono::milliseconds(100)
+static std::thread reclaimer_thread;
+static std::mutex reclaimer_mutex;
+static std::condition_variable reclaimer_condition;
+static bool reclaimer_stop = false;
+
+static void reclaimer_main()
+{
+    pthread_setname_np(pthread_self(), "cfs_reclaim");
+    std::unique_lock lock(reclaimer_mutex);
+    while (!reclaimer_condition.wait_for(lock, RECLAIM_INTERVAL, [] { return reclaimer_stop; }))
+    {
+        lock.unlock();
+        try {
+            // one round per hold of the operations lock, so foreground operations get in between
+            bool more = true;
+            while (more) {
+                std::lock_guard operations_lock(operations_mutex);
+                more = filesystem_instance->reclaim_reserve_round();
+            }
+        } catch (std::exception & e) {
+            error_log("Error during background reclaim: ", e.what());
+        }
+        lock.lock();
+    }
+}
+
 static std::vector<std::string> splitString(const std::string& s, const char delim = '/')
 {
     std::vector<std::string> parts;
@@ -76,6 +106,16 @@ template < typename InodeType >
         return -EIO;                                                                \
     }
 
+/// blocks dirtied while in scope are recorded as dirtied by one inode, so fsync on it can skip the rest
+class dirty_owner_scope_t
+{
+public:
+    explicit dirty_owner_scope_t(const uint64_t inode_id) { filesystem_instance->set_dirty_owner(inode_id); }
+    ~dirty_owner_scope_t() { filesystem_instance->set_dirty_owner(NO_DIRTY_OWNER); }
+    dirty_owner_scope_t(const dirty_owner_scope_t &) = delete;
+    dirty_owner_scope_t & operator=(const dirty_owner_scope_t &) = delete;
+};
+
 #define RETURN_EROFS_IF_INODE_IS_FROZEN(inode)                                      \
     if ((inode).get_inode_blk_attr().frozen) {                                      \
         return -EROFS;                                                              \
@@ -120,7 +160,6 @@ int do_mkdir (const char * path, const mode_t mode)
         auto inode = get_inode_by_path<filesystem::directory_t>(path_vec);
         RETURN_EROFS_IF_INODE_IS_FROZEN(inode);
         inode.create_dentry(target, mode | S_IFDIR);
-        content_changed_out_of_sync_to_fstat = true;
         content_changed_out_of_sync_to_get_inode = true;
         return 0;
     }
@@ -134,6 +173,7 @@ int do_chown (const char * path, const uid_t uid, const gid_t gid)
         std::lock_guard lock(operations_mutex);
         auto inode = get_inode_by_path<filesystem::inode_t>(splitString(path));
         RETURN_EROFS_IF_INODE_IS_FROZEN(inode);
+        const dirty_owner_scope_t dirty_owner(inode.get_inode_id());
         auto header = inode.get_header();
         header.attributes.st_uid = uid;
         header.attributes.st_gid = gid;
@@ -150,6 +190,7 @@ int do_chmod (const char * path, const mode_t mode)
         std::lock_guard lock(operations_mutex);
         auto inode = get_inode_by_path<filesystem::inode_t>(splitString(path));
         RETURN_EROFS_IF_INODE_IS_FROZEN(inode);
+        const dirty_owner_scope_t dirty_owner(inode.get_inode_id());
         auto header = inode.get_header();
         header.attributes.st_mode = mode;
         header.attributes.st_ctim = filesystem::inode_t::get_current_time();
@@ -173,7 +214,6 @@ int do_create (const char * path, const mode_t mode)
             return -EEXIST;
         } catch (...) {}
         inode.create_dentry(target, mode);
-        content_changed_out_of_sync_to_fstat = true;
         content_changed_out_of_sync_to_get_inode = true;
         return 0;
     }
@@ -244,12 +284,12 @@ int do_write (const char * path, const char * buffer, const size_t size, const o
         std::lock_guard lock(operations_mutex);
         auto inode = get_inode_by_path<filesystem::inode_t>(splitString(path));
         RETURN_EROFS_IF_INODE_IS_FROZEN(inode);
+        const dirty_owner_scope_t dirty_owner(inode.get_inode_id());
         if (const auto [attributes] = inode.get_header();
             static_cast<uint64_t>(attributes.st_size) < (offset + size)) // expand on demand
         {
             inode.resize(size + offset);
         }
-        content_changed_out_of_sync_to_fstat = true;
         return static_cast<int>(inode.write(buffer, size, offset));
     }
     CATCH_TAIL
@@ -261,6 +301,7 @@ int do_utimens (const char * path, const timespec tv[2])
         std::lock_guard lock(operations_mutex);
         auto inode = get_inode_by_path<filesystem::inode_t>(splitString(path));
         RETURN_EROFS_IF_INODE_IS_FROZEN(inode);
+        const dirty_owner_scope_t dirty_owner(inode.get_inode_id());
         auto header = inode.get_header();
         header.attributes.st_atim = tv[0];
         header.attributes.st_mtim = tv[1];
@@ -288,7 +329,6 @@ int do_unlink (const char * path)
         }
 
         inode.unlink_inode(target);
-        content_changed_out_of_sync_to_fstat = true;
         content_changed_out_of_sync_to_get_inode = true;
         return 0;
     }
@@ -305,7 +345,6 @@ int do_rmdir (const char * path)
         auto inode = get_inode_by_path<filesystem::directory_t>(path_vec);
         const auto child = inode.get_inode(target);
         auto child_inode = filesystem_instance->make_inode<filesystem::inode_t>(child);
-        content_changed_out_of_sync_to_fstat = true;
         content_changed_out_of_sync_to_get_inode = true;
         if (child_inode.get_inode_blk_attr().frozen == 1) {
             return -EROFS;
@@ -319,11 +358,20 @@ int do_rmdir (const char * path)
     CATCH_TAIL
 }
 
-int do_fsync (const char *, int)
+int do_fsync (const char * path, int)
 {
     try {
         std::lock_guard lock(operations_mutex);
-        filesystem_instance->sync();
+        uint64_t inode_id;
+        try {
+            inode_id = get_inode_by_path<filesystem::inode_t>(splitString(path)).get_inode_id();
+        } catch (fs_error::no_such_file_or_directory &) {
+            // unlinked while open, nothing left to tell its blocks apart by
+            filesystem_instance->sync();
+            return 0;
+        }
+
+        filesystem_instance->fsync(inode_id);
         return 0;
     }
     CATCH_TAIL
@@ -334,11 +382,20 @@ int do_releasedir (const char *)
     return 0;
 }
 
-int do_fsyncdir (const char *, int)
+int do_fsyncdir (const char * path, int)
 {
     try {
         std::lock_guard lock(operations_mutex);
-        filesystem_instance->sync();
+        uint64_t inode_id;
+        try {
+            inode_id = get_inode_by_path<filesystem::inode_t>(splitString(path)).get_inode_id();
+        } catch (fs_error::no_such_file_or_directory &) {
+            // unlinked while open, nothing left to tell its blocks apart by
+            filesystem_instance->sync();
+            return 0;
+        }
+
+        filesystem_instance->fsync(inode_id);
         return 0;
     }
     CATCH_TAIL
@@ -350,8 +407,8 @@ int do_truncate (const char * path, const off_t size)
         std::lock_guard lock(operations_mutex);
         auto inode = get_inode_by_path<filesystem::inode_t>(splitString(path));
         RETURN_EROFS_IF_INODE_IS_FROZEN(inode);
+        const dirty_owner_scope_t dirty_owner(inode.get_inode_id());
         inode.resize(size);
-        content_changed_out_of_sync_to_fstat = true;
         return 0;
     }
     CATCH_TAIL
@@ -369,7 +426,6 @@ int do_symlink (const char * path, const char * target)
         auto new_inode = inode.create_dentry(target_link, S_IFLNK | 0755);
         new_inode.resize(strlen(path));
         new_inode.write(path, strlen(path), 0);
-        content_changed_out_of_sync_to_fstat = true;
         content_changed_out_of_sync_to_get_inode = true;
         return 0;
     }
@@ -392,7 +448,6 @@ int do_snapshot(const char * name)
         auto root = get_inode_by_path<filesystem::directory_t>({});
         root.snapshot(target);
         filesystem_instance->sync();
-        content_changed_out_of_sync_to_fstat = true;
         content_changed_out_of_sync_to_get_inode = true;
         debug_log("Snapshot creation completed for ", name);
         return 0;
@@ -416,12 +471,20 @@ int do_rollback(const char * name)
         filesystem_instance->sync();
         debug_log("Filesystem rollback completed, history inode is ", name);
         path_to_inode_fast_map.clear();
-        content_changed_out_of_sync_to_fstat = true;
         content_changed_out_of_sync_to_get_inode = true;
         return 0;
     } CATCH_TAIL
 }
 
+int do_drop_caches()
+{
+    try {
+        std::lock_guard lock(operations_mutex);
+        filesystem_instance->drop_caches();
+        return 0;
+    } CATCH_TAIL
+}
+
 int do_rename (const char * path, const char * name)
 {
     try {
@@ -454,7 +517,6 @@ int do_rename (const char * path, const char * name)
         }
         target_dentries.emplace(target, index_node_id);
         target_parent_dir.save_dentries(target_dentries);
-        content_changed_out_of_sync_to_fstat = true;
         content_changed_out_of_sync_to_get_inode = true;
         return 0;
     }
@@ -464,15 +526,24 @@ int do_rename (const char * path, const char * name)
 int do_fallocate(const char * path, const int mode, const off_t offset, const off_t length)
 {
     try {
+        // only plain allocation, mode holds FALLOC_FL_* flags. space is reserved for the lifetime of the mount,
+        // holes still unwritten at unmount are allocated on demand afterwards, and may then run out of space
+        if (mode != 0) {
+            return -EOPNOTSUPP;
+        }
+
+        if (offset < 0 || length <= 0) {
+            return -EINVAL;
+        }
+
         std::lock_guard lock(operations_mutex);
         auto inode = get_inode_by_path<filesystem::inode_t>(splitString(path));
         RETURN_EROFS_IF_INODE_IS_FROZEN(inode);
-        inode.resize(offset + length);
+        const dirty_owner_scope_t dirty_owner(inode.get_inode_id());
+        inode.fallocate(offset, length);
         auto header = inode.get_header();
-        header.attributes.st_mode = mode | S_IFREG;
         header.attributes.st_ctim = filesystem::inode_t::get_current_time();
         inode.save_header(header);
-        content_changed_out_of_sync_to_fstat = true;
         return 0;
     }
     CATCH_TAIL
@@ -506,14 +577,29 @@ int do_readlink (const char * path, char * buffer, const size_t size)
 
 void do_destroy ()
 {
+    // reclaimer takes the operations lock, stop it first
+    if (reclaimer_thread.joinable())
+    {
+        {
+            std::lock_guard lock(reclaimer_mutex);
+            reclaimer_stop = true;
+        }
+        reclaimer_condition.notify_all();
+        reclaimer_thread.join();
+    }
+
     std::lock_guard lock(operations_mutex);
     filesystem_instance.reset();
 }
 
-void do_init(const std::string & location)
+void do_init(const std::string & location, const mount_options_t & options)
 {
     std::lock_guard lock(operations_mutex);
-    filesystem_instance = std::make_unique<filesystem>(location.c_str());
+    filesystem_instance = std::make_unique<filesystem>(location.c_str(), options);
+    if (filesystem_instance->reserve_enabled()) {
+        reclaimer_stop = false;
+        reclaimer_thread = std::thread(reclaimer_main);
+    }
 }
 
 int do_mknod (const char * path, const mode_t mode, const dev_t device)
@@ -530,30 +616,14 @@ int do_mknod (const char * path, const mode_t mode, const dev_t device)
         auto header = new_inode.get_header();
         header.attributes.st_dev = device;
         inode.save_header(header);
-        content_changed_out_of_sync_to_fstat = true;
         content_changed_out_of_sync_to_get_inode = true;
         return 0;
     }
     CATCH_TAIL;
 }
 
-struct statvfs statvfs_5s_interval_cache;
-std::chrono::time_point<std::chrono::system_clock> last_fstat_invoke_time;
-std::mutex do_fstat_unique_mutex;
-
 struct statvfs do_fstat()
 {
-    std::lock_guard lock_do_fstat(do_fstat_unique_mutex);
-    const auto now = std::chrono::system_clock::now();
-    if (const auto sec = std::chrono::duration_cast<std::chrono::seconds>(now - last_fstat_invoke_time).count();
-        sec > 5 && content_changed_out_of_sync_to_fstat)
-    {
-        std::lock_guard lock(operations_mutex);
-        statvfs_5s_interval_cache = filesystem_instance->fstat();
-        last_fstat_invoke_time = now;
-        content_changed_out_of_sync_to_fstat = false;
-        return statvfs_5s_interval_cache;
-    }
-
-    return statvfs_5s_interval_cache;
+    std::lock_guard lock(operations_mutex);
+    return filesystem_instance->fstat();
 }
@@ -22,7 +22,10 @@
 #include <thread>
 #include <cstring>
 #include <vector>
+#include <algorithm>
 #include <filesystem>
+#include <random>
+#include <bit>
 #include "helper/cpp_assert.h"
 #include "helper/lz4.h"
 #include "test/test.h"
@@ -32,6 +35,8 @@
 #include "core/bitmap.h"
 #include "core/ring_buffer.h"
 #include "core/block_attr.h"
+#include "core/blk_manager.h"
+#include "core/hash_table.h"
 
 #define RANDOM (static_cast<int>(test::fast_rand64()) & 0x7FFFFFFF)
 
@@ -165,6 +170,47 @@ public:
     }
 } lz4_test;
 
+class hash_table_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "Hash table test";
+    }
+
+    std::string success() override {
+        return "Hash table test succeeded";
+    }
+
+    std::string failure() override {
+        return "Hash table test failed";
+    }
+
+    bool run() override
+    {
+        // mirror random inserts and erases into std::map, then compare
+        open_hash_table_t < uint64_t > table;
+        std::map < uint64_t, uint64_t * > reference;
+        std::vector < uint64_t > values(4096);
+        for (int i = 0; i < 200000; i++)
+        {
+            const uint64_t key = RANDOM % 4096;
+            if (RANDOM % 3 == 0) {
+                if (table.erase(key) != (reference.contains(key) ? reference.at(key) : nullptr)) return false;
+                reference.erase(key);
+            } else {
+                table.insert(key, &values[key]);
+                reference[key] = &values[key];
+            }
+        }
+
+        if (table.size() != reference.size()) return false;
+        for (uint64_t key = 0; key < 4096; key++) {
+            if (table.find(key) != (reference.contains(key) ? reference.at(key) : nullptr)) return false;
+        }
+
+        return true;
+    }
+} hash_table_test;
+
 class basic_io_test_ final : test::unit_t {
     std::string name() override {
         return "BasicIO test";
@@ -190,6 +236,80 @@ class basic_io_test_ final : test::unit_t {
             std::filesystem::copy_file(SOURCE_DIR "/data/disk.img", "/tmp/.disk_img");
             basic_io_t basic_io;
             basic_io.open("/tmp/.disk_img");
+
+            // vectored write, then read back as one continuous range
+            std::vector<uint8_t> first(512 * 3), second(512 * 5), readback(512 * 8);
+            for (auto & c : first) c = RANDOM % 255;
+            for (auto & c : second) c = RANDOM % 255;
+            const iovec vectors[] = {
+                { .iov_base = first.data(), .iov_len = first.size() },
+                { .iov_base = second.data(), .iov_len = second.size() },
+            };
+            basic_io.writev(vectors, 2, 16);
+            basic_io.read(readback.data(), 16, 8);
+            assert_short(!std::memcmp(readback.data(), first.data(), first.size()));
+            assert_short(!std::memcmp(readback.data() + first.size(), second.data(), second.size()));
+
+            // continuous write, then scatter read
+            for (auto & c : readback) c = RANDOM % 255;
+            basic_io.write(readback.data(), 16, 8);
+            const iovec scatter[] = {
+                { .iov_base = first.data(), .iov_len = first.size() },
+                { .iov_base = second.data(), .iov_len = second.size() },
+            };
+            basic_io.readv(scatter, 2, 16);
+            assert_short(!std::memcmp(readback.data(), first.data(), first.size()));
+            assert_short(!std::memcmp(readback.data() + first.size(), second.data(), second.size()));
+            basic_io.close();
+
+            // queued requests, on both backends
+            for (const auto backend : { basic_io_t::SYNCHRONOUS_IO, basic_io_t::IO_URING })
+            {
+                basic_io.open("/tmp/.disk_img", backend);
+                for (auto & c : first) c = RANDOM % 255;
+                for (auto & c : second) c = RANDOM % 255;
+                basic_io.queue_write(first.data(), 32, 3);
+                basic_io.queue_writev(vectors + 1, 1, 35);
+                basic_io.submit();
+                basic_io.wait();
+
+                int64_t transferred = 0;
+                basic_io.queue_read(readback.data(), 32, 8, [&](const int64_t result) { transferred = result; });
+                basic_io.submit();
+                basic_io.wait();
+                assert_short(transferred == static_cast<int64_t>(readback.size()));
+                assert_short(!std::memcmp(readback.data(), first.data(), first.size()));
+                assert_short(!std::memcmp(readback.data() + first.size(), second.data(), second.size()));
+                basic_io.close();
+            }
+
+            // direct IO, unaligned buffers are bounced
+            basic_io.open("/tmp/.disk_img", basic_io_t::SYNCHRONOUS_IO, true);
+            for (auto & c : readback) c = RANDOM % 255;
+            basic_io.write(readback.data() + 1, 48, 1);
+            basic_io.read(first.data() + 1, 48, 1);
+            assert_short(!std::memcmp(readback.data() + 1, first.data() + 1, 512));
+            basic_io.close();
+
+            // mapped disk, writes through mapping are visible to sector reads
+            basic_io.open("/tmp/.disk_img");
+            uint8_t * mapping = basic_io.map();
+            for (auto & c : second) c = RANDOM % 255;
+            std::memcpy(mapping + 64 * 512, second.data(), second.size());
+            basic_io.sync_mapped(64, 5);
+            basic_io.read(readback.data(), 64, 5);
+            assert_short(!std::memcmp(readback.data(), second.data(), second.size()));
+            basic_io.close();
+
+            // discarded sectors of an image file read back as zeros
+            basic_io.open("/tmp/.disk_img");
+            if (basic_io.discard(64, 8)) {
+                basic_io.read(readback.data(), 64, 8);
+                assert_short(std::ranges::all_of(readback, [](const uint8_t c) { return c == 0; }));
+            }
+            basic_io.close();
+
+            std::filesystem::remove("/tmp/.disk_img");
         } catch (const std::exception & e) {
             try { std::filesystem::remove("/tmp/.disk_img"); } catch (...) { }
             reason = e.what();
@@ -233,6 +353,115 @@ class block_io_test_ final : test::unit_t {
                 data.reserve(block_io.get_block_size());
                 blk->get(data.data(), block_io.get_block_size(), 0);
             }
+
+            // write through a tiny cache, evicted blocks must be written back
+            {
+                block_io_t block_io(basic_io);
+                block_io.set_max_cached_block_number(16);
+                for (uint64_t i = 1; i <= 256; i++) {
+                    block_io.safe_at(i)->update(reinterpret_cast<const uint8_t *>(&i), sizeof(i), 0);
+                }
+                assert_short(block_io.get_cached_block_number() <= 16);
+
+                for (uint64_t i = 1; i <= 256; i++) {
+                    uint64_t value = 0;
+                    block_io.safe_at(i)->get(reinterpret_cast<uint8_t *>(&value), sizeof(value), 0);
+                    assert_short(value == i);
+                }
+            }
+
+            // past the dirty limit, writers kick background write-back, which brings dirty blocks
+            // under background ratio on its own. throttling itself is bounded in time and not asserted
+            {
+                block_io_t block_io(basic_io);
+                block_io.set_max_cached_block_number(100);
+                for (uint64_t i = 1; i <= 80; i++) {
+                    block_io.safe_at(i)->update(reinterpret_cast<const uint8_t *>(&i), sizeof(i), 0);
+                }
+                const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+                while (block_io.get_dirty_block_number() > 10 && std::chrono::steady_clock::now() < deadline) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+                assert_short(block_io.get_dirty_block_number() <= 10);
+                block_io.sync();
+                assert_short(block_io.get_dirty_block_number() == 0);
+                for (uint64_t i = 1; i <= 80; i++) {
+                    uint64_t value = 0;
+                    block_io.safe_at(i)->get(reinterpret_cast<uint8_t *>(&value), sizeof(value), 0);
+                    assert_short(value == i);
+                }
+            }
+
+            // sync keeps the hot set cached, only drop_caches() empties the cache
+            {
+                block_io_t block_io(basic_io);
+                for (uint64_t i = 1; i <= 8; i++) {
+                    block_io.safe_at(i)->update(reinterpret_cast<const uint8_t *>(&i), sizeof(i), 0);
+                }
+                block_io.sync();
+                for (uint64_t i = 1; i <= 8; i++) {
+                    assert_short(block_io.is_cached(i));
+                }
+                block_io.drop_caches();
+                for (uint64_t i = 1; i <= 8; i++) {
+                    assert_short(!block_io.is_cached(i));
+                    uint64_t value = 0;
+                    block_io.safe_at(i)->get(reinterpret_cast<uint8_t *>(&value), sizeof(value), 0);
+                    assert_short(value == i);
+                }
+            }
+
+            // per inode sync leaves blocks dirtied only by other inodes alone
+            {
+                block_io_t block_io(basic_io);
+                auto dirty = [&](const uint64_t owner, const uint64_t index) {
+                    block_io.set_dirty_owner(owner);
+                    block_io.safe_at(index)->update(reinterpret_cast<const uint8_t *>(&index), sizeof(index), 0);
+                };
+                dirty(1, 10);
+                dirty(2, 11);
+                dirty(NO_DIRTY_OWNER, 12);
+                dirty(1, 13);
+                dirty(2, 13);           // shared by two inodes
+                block_io.set_dirty_owner(NO_DIRTY_OWNER);
+                block_io.sync_owner(1);
+                assert_short(block_io.get_dirty_block_number() == 1);
+                block_io.sync_owner(2);
+                assert_short(block_io.get_dirty_block_number() == 0);
+            }
+
+            // prefetch reads a batch into cache, with the same content as reads on demand
+            {
+                block_io_t block_io(basic_io);
+                const std::vector < uint64_t > indices = { 20, 21, 22, 30, 31, 40 };
+                block_io.prefetch(indices);
+                for (const auto i : indices) {
+                    assert_short(block_io.is_cached(i));
+                    uint64_t value = 0;
+                    block_io.safe_at(i)->get(reinterpret_cast<uint8_t *>(&value), sizeof(value), 0);
+                    assert_short(value == i);
+                }
+            }
+
+            // scan resistance, re-referenced blocks survive a long sequential read
+            for (const auto policy : { "2q", "arc" })
+            {
+                block_io_t block_io(basic_io, false, { .cache_policy = policy });
+                block_io.set_max_cached_block_number(64);
+                auto touch = [&](const uint64_t from, const uint64_t to) {
+                    for (uint64_t i = from; i < to; i++) {
+                        block_io.safe_at(i, true);
+                    }
+                };
+                touch(1, 17);       // hot set
+                touch(100, 164);    // push hot set out once
+                touch(1, 17);       // re-reference (2Q learns from its history of evicted blocks)
+                touch(1, 17);       // and again while cached (ARC learns from hits)
+                touch(300, 800);    // cold scan
+                for (uint64_t i = 1; i < 17; i++) {
+                    assert_short(block_io.is_cached(i));
+                }
+            }
             basic_io.close();
             std::filesystem::remove("/tmp/.disk_img");
         } catch (const std::exception & e) {
@@ -292,6 +521,59 @@ class bitmap_test_ final : test::unit_t {
                 for (int i = 0; i < 12288; i++) {
                     assert_short(!bmap.get(i));
                 }
+                assert_short(bmap.free_count() == 12288);
+
+                // free bit search, within a word, across words, and across full runs longer than one SIMD lane
+                for (int i = 0; i < 1000; i++) {
+                    bmap.set(i, true);
+                }
+                assert_short(bmap.find_zero(0) == 1000);
+                assert_short(bmap.find_zero(1001) == 1001);
+                bmap.set(1000, true);
+                assert_short(bmap.find_zero(0) == 1001);
+                bmap.set(37, false);
+                assert_short(bmap.find_zero(0) == 37 && bmap.find_zero(38) == 1001);
+                for (int i = 1001; i < 12288; i++) {
+                    bmap.set(i, true);
+                }
+                assert_short(bmap.find_zero(38) == 12288);
+                bmap.set(12287, false);
+                assert_short(bmap.find_zero(38) == 12287);     // skips two full groups
+                assert_short(bmap.free_count() == 2);
+
+                // free run lengths, capped by max, by the next set bit, and by the boundary
+                for (int i = 100; i < 300; i++) {
+                    bmap.set(i, false);
+                }
+                assert_short(bmap.zero_run(100, 1000) == 200 && bmap.zero_run(100, 50) == 50 && bmap.zero_run(250, 1000) == 50);
+                assert_short(bmap.zero_run(37, 10) == 1 && bmap.zero_run(38, 10) == 0 && bmap.zero_run(12287, 10) == 1);
+                for (int i = 100; i < 300; i++) {
+                    bmap.set(i, true);
+                }
+
+                // changes reach map blocks on flush
+                bmap.flush();
+                bitmap reloaded(block_io, 1, 4, 12288, cfs_head.static_info.block_size);
+                for (int i = 0; i < 12288; i++) {
+                    assert_short(reloaded.get(i) == bmap.get(i));
+                }
+                assert_short(reloaded.free_count() == 2 && reloaded.find_zero(38) == 12287);
+
+                // mirror is written from the map on flush, and restores a damaged map
+                bitmap mirrored(block_io, 1, 4, 12288, cfs_head.static_info.block_size, 8);
+                mirrored.mark_all_dirty();
+                mirrored.flush();
+                const uint64_t checksum = mirrored.checksum();
+                assert_short(mirrored.mirror_checksum() == checksum);
+                const uint64_t garbage = 0x5a5a5a5a5a5a5a5a;
+                block_io.safe_at(1)->update(reinterpret_cast<const uint8_t *>(&garbage), sizeof(garbage), 0);
+                bitmap damaged(block_io, 1, 4, 12288, cfs_head.static_info.block_size, 8);
+                assert_short(damaged.checksum() != checksum && damaged.mirror_checksum() == checksum);
+                damaged.load_mirror();
+                assert_short(damaged.checksum() == checksum && damaged.free_count() == 2);
+                for (int i = 0; i < 12288; i++) {
+                    assert_short(damaged.get(i) == bmap.get(i));
+                }
             }
             basic_io.close();
             std::filesystem::remove("/tmp/.disk_img");
@@ -426,6 +708,30 @@ class block_attr_test_ final : test::unit_t {
                 for (int i = 0; i < 12288; i++) {
                     assert_short(!battr.get(i));
                 }
+
+                // bulk access, across table block borders
+                std::vector<uint16_t> values(5000), back(5000);
+                for (auto & value : values) {
+                    value = RANDOM % 65535;
+                }
+                battr.set_range(1000, values.size(), values.data());
+                battr.get_range(1000, back.size(), back.data());
+                assert_short(values == back && battr.get(999) == 0 && battr.get(6000) == 0);
+
+                uint64_t visited = 0;
+                battr.for_each(0, 12288, [&](const uint64_t index, uint16_t & value) {
+                    assert_short(value == (index >= 1000 && index < 6000 ? values[index - 1000] : 0));
+                    value = static_cast<uint16_t>(index);
+                    visited++;
+                });
+                assert_short(visited == 12288 && battr.get(12287) == 12287);
+
+                // changes reach table blocks on flush
+                battr.flush();
+                block_attr_t reloaded(block_io, cfs_head.static_info.block_size, 1, 5, 12288);
+                for (int i = 0; i < 12288; i++) {
+                    assert_short(reloaded.get(i) == i);
+                }
             }
             basic_io.close();
             std::filesystem::remove("/tmp/.disk_img");
@@ -439,6 +745,289 @@ class block_attr_test_ final : test::unit_t {
     }
 } block_attr;
 
+class blk_manager_test_ final : test::unit_t {
+    std::string name() override {
+        return "Block manager test";
+    }
+
+    std::string success() override {
+        return "Block manager test succeeded";
+    }
+
+
+    std::string reason;
+
+    std::string failure() override {
+        return "Block manager test failed: " + reason;
+    }
+
+    /// allocate every block, then leave blocks free, frozen, COW redundancy, or data with up to 127 links at random
+    static void scramble(blk_manager & manager, const uint64_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        while (true) {
+            try { manager.allocate_block(); } catch (blk_manager::no_space_available &) { break; }
+        }
+
+        for (uint64_t i = 1; i < manager.blk_count; i++)
+        {
+            cfs_blk_attr_t attr{};
+            attr.type = rng() % 4;
+            attr.cow_refresh_count = rng() % 4;
+            attr.links = rng() % 128;
+            switch (rng() % 5) {
+                case 0: manager.free_block(i); continue;
+                case 1: attr.frozen = 1 + rng() % 3; break;
+                case 2: attr.type = COW_REDUNDANCY_TYPE; break;
+                case 3: attr.type = 1 + rng() % 3; attr.links = 127; break;
+                default: attr.type = 1 + rng() % 3; break;
+            }
+            manager.set_attr(i, attr);
+        }
+    }
+
+    struct volume_state_t {
+        std::vector < bool > allocated;
+        std::vector < uint16_t > attributes;
+        bool operator==(const volume_state_t &) const = default;
+    };
+
+    static volume_state_t state_of(blk_manager & manager)
+    {
+        volume_state_t state;
+        for (uint64_t i = 0; i < manager.blk_count; i++) {
+            const auto attr = manager.get_attr(i);
+            state.allocated.push_back(manager.block_allocated(i));
+            state.attributes.push_back(std::bit_cast<uint16_t>(attr));
+        }
+        return state;
+    }
+
+    bool run() override
+    {
+        try {
+            for (const auto * image : { "/tmp/.disk_img", "/tmp/.disk_img_scalar" }) {
+                if (std::filesystem::exists(image)) {
+                    std::filesystem::remove(image);
+                }
+                std::filesystem::copy_file(SOURCE_DIR "/data/disk.img", image);
+            }
+
+            // whole-volume scans, SIMD kernels against scalar ones and against attributes changed one by one,
+            // the last bitmap word is partial unless the block count is a multiple of 64
+            {
+                basic_io_t simd_io, scalar_io;
+                simd_io.open("/tmp/.disk_img");
+                scalar_io.open("/tmp/.disk_img_scalar");
+                {
+                    block_io_t simd_block_io(simd_io), scalar_block_io(scalar_io);
+                    blk_manager simd(simd_block_io), scalar(scalar_block_io);
+                    scalar.scalar_scans = true;
+                    scramble(simd, 1);
+                    scramble(scalar, 1);
+                    assert_short(state_of(simd) == state_of(scalar));
+
+                    auto expected = state_of(simd);
+                    uint64_t frozen = simd.allocated_frozen_blocks();
+                    for (uint64_t i = 1; i < simd.blk_count; i++)
+                    {
+                        auto attr = std::bit_cast<cfs_blk_attr_t>(expected.attributes[i]);
+                        if (expected.allocated[i] && !attr.frozen && attr.type != COW_REDUNDANCY_TYPE) {
+                            attr.frozen = 1;
+                            attr.links = (attr.links + 1) & 127; // 127 wraps, as links++ always did
+                            expected.attributes[i] = std::bit_cast<uint16_t>(attr);
+                            frozen++;
+                        }
+                    }
+                    simd.freeze_data_blocks();
+                    scalar.freeze_data_blocks();
+                    assert_short(state_of(simd) == expected && state_of(scalar) == expected);
+                    assert_short(simd.allocated_frozen_blocks() == frozen && scalar.allocated_frozen_blocks() == frozen);
+
+                    scramble(simd, 2);
+                    scramble(scalar, 2);
+                    expected = state_of(simd);
+                    for (uint64_t i = 1; i < simd.blk_count; i++)
+                    {
+                        const auto attr = std::bit_cast<cfs_blk_attr_t>(expected.attributes[i]);
+                        if (!attr.frozen && attr.type != COW_REDUNDANCY_TYPE) {
+                            expected.allocated[i] = false;
+                        }
+                    }
+                    simd.free_data_blocks();
+                    scalar.free_data_blocks();
+                    assert_short(state_of(simd) == expected && state_of(scalar) == expected);
+                    assert_short(simd.free_blocks() == scalar.free_blocks());
+                }
+                simd_io.close();
+                scalar_io.close();
+            }
+
+            std::filesystem::remove("/tmp/.disk_img");
+            std::filesystem::remove("/tmp/.disk_img_scalar");
+        } catch (const std::exception & e) {
+            try { std::filesystem::remove("/tmp/.disk_img"); } catch (...) { }
+            try { std::filesystem::remove("/tmp/.disk_img_scalar"); } catch (...) { }
+            reason = e.what();
+            return false;
+        }
+
+        return true;
+    }
+} blk_manager_test;
+
+class cow_reclaim_test_ final : test::unit_t {
+    std::string name() override {
+        return "COW reclaim test";
+    }
+
+    std::string success() override {
+        return "COW reclaim test succeeded";
+    }
+
+
+    std::string reason;
+
+    std::string failure() override {
+        return "COW reclaim test failed: " + reason;
+    }
+
+    bool run() override
+    {
+        try {
+            if (std::filesystem::exists("/tmp/.disk_img_cow")) {
+                std::filesystem::remove("/tmp/.disk_img_cow");
+            }
+            std::filesystem::copy_file(SOURCE_DIR "/data/disk.img", "/tmp/.disk_img_cow");
+            basic_io_t basic_io;
+            basic_io.open("/tmp/.disk_img_cow");
+            {
+                block_io_t block_io(basic_io);
+                blk_manager manager(block_io);
+                while (manager.reclaim_cow_blocks() != 0) { }
+
+                // COW blocks are reclaimed lowest refresh count first, the lowest tier once per round,
+                // and a round with nothing expired still frees the next tier
+                std::vector < uint64_t > blocks;
+                for (const uint16_t refresh : { 0, 0, 2, 3 })
+                {
+                    blocks.push_back(manager.allocate_block());
+                    manager.set_attr(blocks.back(), cfs_blk_attr_t{ .frozen = 0, .type = COW_REDUNDANCY_TYPE,
+                        .type_backup = 0, .cow_refresh_count = refresh, .newly_allocated_thus_no_cow = 0, .links = 0 });
+                }
+                assert_short(manager.allocated_cow_blocks() == 4);
+                assert_short(manager.reclaim_cow_blocks() == 2);
+                assert_short(!manager.block_allocated(blocks[0]) && !manager.block_allocated(blocks[1]));
+                assert_short(manager.block_allocated(blocks[2]) && manager.block_allocated(blocks[3]));
+                assert_short(manager.reclaim_cow_blocks() == 1 && !manager.block_allocated(blocks[2]));
+                assert_short(manager.reclaim_cow_blocks() == 1 && !manager.block_allocated(blocks[3]));
+                assert_short(manager.reclaim_cow_blocks() == 0 && manager.allocated_cow_blocks() == 0);
+            }
+            basic_io.close();
+            std::filesystem::remove("/tmp/.disk_img_cow");
+        } catch (const std::exception & e) {
+            try { std::filesystem::remove("/tmp/.disk_img_cow"); } catch (...) { }
+            reason = e.what();
+            return false;
+        }
+
+        return true;
+    }
+} cow_reclaim_test;
+
+class blk_reservation_test_ final : test::unit_t {
+    std::string name() override {
+        return "Block reservation test";
+    }
+
+    std::string success() override {
+        return "Block reservation test succeeded";
+    }
+
+
+    std::string reason;
+
+    std::string failure() override {
+        return "Block reservation test failed: " + reason;
+    }
+
+    bool run() override
+    {
+        try {
+            if (std::filesystem::exists("/tmp/.disk_img_reserve")) {
+                std::filesystem::remove("/tmp/.disk_img_reserve");
+            }
+            std::filesystem::copy_file(SOURCE_DIR "/data/disk.img", "/tmp/.disk_img_reserve");
+            basic_io_t basic_io;
+            basic_io.open("/tmp/.disk_img_reserve");
+            uint64_t generation = 0;
+            {
+                block_io_t block_io(basic_io);
+                blk_manager manager(block_io);
+                while (manager.reclaim_cow_blocks() != 0) { }
+
+                // reserved blocks stay free, and out of reach of allocations, until given back
+                const uint64_t free = manager.free_blocks();
+                assert_short(free > 8);
+                manager.reserve(free - 3);
+                assert_short(manager.free_blocks() == 3 && manager.reserved() == free - 3);
+                uint64_t allocated = 0;
+                while (allocated < 3)
+                {
+                    const auto [start, length] = manager.allocate_extent(1, 8);
+                    assert_short(length <= 3 - allocated);
+                    allocated += length;
+                }
+                bool depleted = false;
+                try { manager.allocate_block(); } catch (blk_manager::no_space_available &) { depleted = true; }
+                assert_short(depleted);
+                depleted = false;
+                try { manager.reserve(1); } catch (blk_manager::no_space_available &) { depleted = true; }
+                assert_short(depleted && manager.reserved() == free - 3);
+                manager.release_reserved(2);
+                assert_short(manager.free_blocks() == 2);
+                manager.allocate_block();
+                manager.release_reserved(free - 5);
+                assert_short(manager.reserved() == 0 && manager.free_blocks() == free - 4);
+
+                // what is left reserved outlives the mount
+                manager.reserve(5);
+                generation = manager.reservation_generation();
+            }
+
+            {
+                block_io_t block_io(basic_io);
+                blk_manager manager(block_io);
+                assert_short(manager.reserved() == 5 && manager.reservation_generation() == generation);
+                manager.drop_reservations();
+                assert_short(manager.reserved() == 0 && manager.reservation_generation() == generation + 1);
+                manager.reserve(2);
+            }
+
+            // an unclean unmount drops every reservation
+            {
+                sector_data_t header_sector;
+                basic_io.read(header_sector, 0);
+                reinterpret_cast<cfs_head_t *>(header_sector.data())->runtime_info.flags.clean = false;
+                basic_io.write(header_sector, 0);
+            }
+            {
+                block_io_t block_io(basic_io);
+                blk_manager manager(block_io);
+                assert_short(manager.reserved() == 0 && manager.reservation_generation() == generation + 2);
+            }
+            basic_io.close();
+            std::filesystem::remove("/tmp/.disk_img_reserve");
+        } catch (const std::exception & e) {
+            try { std::filesystem::remove("/tmp/.disk_img_reserve"); } catch (...) { }
+            reason = e.what();
+            return false;
+        }
+
+        return true;
+    }
+} blk_reservation_test;
+
 std::map < std::string, void * > test::unit_tests = {
     // unit test dummies
     { "@@__delay_faulty__", &failed_delay_test },
@@ -447,9 +1036,11 @@ std::map < std::string, void * > test::unit_tests = {
     { "@@__delay_simple__", &delay_unit_test },
     // unit test dummies end
 
-    { "LZ4", &lz4_test }, // utilities
+    { "LZ4", &lz4_test }, { "HashTable", &hash_table_test }, // utilities
     {"BasicIO", &basic_io_test }, { "BlockIO", &block_io_test }, // Basic filesystem IO
-    { "Bitmap", &bitmap_test }, { "RingBuffer", &ringbuffer_test }, { "BlockAttr", &block_attr }
+    { "Bitmap", &bitmap_test }, { "RingBuffer", &ringbuffer_test }, { "BlockAttr", &block_attr },
+    { "BlkManager", &blk_manager_test }, { "CowReclaim", &cow_reclaim_test },
+    { "BlkReservation", &blk_reservation_test }
 };
 
 #endif
@@ -105,6 +105,8 @@ cfs_head_t print_head(cfs_head_t head)
     console_log("  ─────────────────────────────┴───────────────────────────────────────────────────────────────────────");
     console_log(color::color(5,5,5), std::dec, "Filesystem Allocated Blocks: ", head.runtime_info.allocated_blocks);
     console_log(color::color(5,5,5), std::dec, "Filesystem Last Allocated Block: ", head.runtime_info.last_allocated_block);
+    console_log(color::color(5,5,5), std::dec, "Filesystem COW Redundancy Blocks: ", head.usage_info.cow_blocks);
+    console_log(color::color(5,5,5), std::dec, "Filesystem Frozen Blocks: ", head.usage_info.frozen_blocks);
     console_log("=======================================================================================================");
 
     return head;
@@ -35,6 +35,7 @@ extern "C" struct snapshot_ioctl_msg {
     uint64_t action;
 };
 #define CFS_PUSH_SNAPSHOT _IOW('M', 0x42, struct snapshot_ioctl_msg)
+#define CFS_DROP_CACHES _IO('M', 0x43)
 
 #define CREATE      (0)
 #define ROLLBACKTO  (1)
@@ -47,6 +48,7 @@ inline void set_thread_name(const char * name)
 namespace mount {
     static std::string filesystem_path;
     static std::string filesystem_mount_destination;
+    static mount_options_t filesystem_options;
 
     static int fuse_do_getattr (const char *path, struct stat *stbuf)
     {
@@ -178,6 +180,10 @@ namespace mount {
             }
         }
 
+        if (cmd == CFS_DROP_CACHES) {
+            return do_drop_caches();
+        }
+
         return -EINVAL;
     }
 
@@ -270,6 +276,7 @@ namespace mount {
         { .name = "version",    .short_name = 'v', .arg_required = false,   .description = "Prints version" },
         { .name = "verbose",    .short_name = 'V', .arg_required = false,   .description = "Enable verbose output" },
         { .name = "fuse",       .short_name = 'f', .arg_required = true,    .description = "Arguments passed to fuse" },
+        { .name = "options",    .short_name = 'o', .arg_required = true,    .description = "Comma separated filesystem options: io_uring,direct_io,mmap,discard,cache=lru|2q|arc,hugepages,reserve=<percent>. mmap gives no write ordering, and crashes on IO errors" },
     };
 
     void print_help(const std::string & program_name)
@@ -314,6 +321,43 @@ namespace mount {
 
         return parts;
     }
+
+    static mount_options_t parse_options(const std::string & options)
+    {
+        mount_options_t ret;
+        for (const auto & option : splitString(options, ','))
+        {
+            if (option.empty()) {
+                continue;
+            }
+
+            if (option == "io_uring") {
+                ret.io_uring = true;
+            } else if (option == "direct_io") {
+                ret.direct_io = true;
+            } else if (option == "mmap") {
+                ret.mmap = true;
+            } else if (option == "discard") {
+                ret.discard = true;
+            } else if (option == "hugepages") {
+                ret.huge_pages = true;
+            } else if (option.starts_with("reserve=")) {
+                ret.reserve = std::stoull(option.substr(option.find('=') + 1));
+                if (ret.reserve > 50) {
+                    throw std::invalid_argument("Reserve too large: " + option);
+                }
+            } else if (option.starts_with("cache=")) {
+                ret.cache_policy = option.substr(option.find('=') + 1);
+                if (ret.cache_policy != "lru" && ret.cache_policy != "2q" && ret.cache_policy != "arc") {
+                    throw std::invalid_argument("Unknown cache policy: " + ret.cache_policy);
+                }
+            } else {
+                throw std::invalid_argument("Unknown filesystem option: " + option);
+            }
+        }
+
+        return ret;
+    }
 }
 
 int fuse_redirect(const int argc, char ** argv)
@@ -326,7 +370,7 @@ int fuse_redirect(const int argc, char ** argv)
         return EXIT_FAILURE;
     }
 
-    do_init(mount::filesystem_path);
+    do_init(mount::filesystem_path, mount::filesystem_options);
     const int ret = fuse_main(args.argc, args.argv, &mount::fuse_operation_vector_table, nullptr);
     fuse_opt_free_args(&args);
     return ret;
@@ -372,6 +416,10 @@ int mount_main(int argc, char **argv)
             verbose_log("Verbose mode enabled");
         }
 
+        if (contains("options", arg_val)) {
+            mount::filesystem_options = mount::parse_options(arg_val);
+        }
+
         ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         std::unique_ptr<char*[]> fuse_argv;
         contains("fuse", arg_val);